@@ -0,0 +1,234 @@
+#include "kaleidoscope.h"
+#include "ModuleOptimizer.h"
+#include "programs.h"
+
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Each compiler phase is timed on its own, over inputs generated in every shape the programs.h generators make,
+// with what the phases before it produce set up while the timer is paused.
+
+static llvm::ExitOnError EXIT_ON_ERROR;
+
+// Created in main, which also sets up the native target the sessions compile for.
+static std::unique_ptr<llvm::orc::KaleidoscopeJIT> THE_JIT;// compiles without passes, for materialization
+static std::unique_ptr<llvm::orc::KaleidoscopeJIT> FAST_JIT;// compiles at -O2, for execution
+
+/// open - A session compiling source ahead of time, for the JIT's data layout.
+static std::unique_ptr<CompilerSession> open(const std::string &source) {
+    return CompilerSession::create(THE_JIT->getDataLayout(), Lexer::from_string(source));
+}
+
+template<class Generator>
+static void BM_Lex(benchmark::State &state, Generator generate) {
+    auto source = generate(state.range(0));
+    for (auto _ : state) {
+        auto lexer = Lexer::from_string(source);
+        size_t tokens = 0;
+        while (lexer->next() != tok_eof) ++tokens;
+        benchmark::DoNotOptimize(tokens);
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+
+template<class Generator>
+static void BM_Parse(benchmark::State &state, Generator generate) {
+    auto source = generate(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto session = open(source);
+        state.ResumeTiming();
+        auto items = session->parse_items();
+        benchmark::DoNotOptimize(items.data());
+        state.PauseTiming();
+        items.clear();
+        session.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+
+template<class Generator>
+static void BM_Codegen(benchmark::State &state, Generator generate) {
+    auto source = generate(state.range(0));
+    size_t functions = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto session = open(source);
+        auto items = session->parse_items();
+        functions = std::count_if(items.begin(), items.end(), [](auto &item) { return item.fn != nullptr; });
+        state.ResumeTiming();
+        for (auto &item : items)
+            if (item.proto)
+                session->update_function_proto(std::move(item.proto));
+            else
+                benchmark::DoNotOptimize(session->codegen(*item.fn));
+        state.PauseTiming();
+        items.clear();
+        session.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * functions);
+}
+
+/// compile - Emit every definition of source into a single module, as compile_aot does before its passes.
+static llvm::orc::ThreadSafeModule compile(const std::string &source) {
+    auto session = open(source);
+    auto module = session->compile_module();
+    if (session->get_error_count())
+        EXIT_ON_ERROR(llvm::createStringError(llvm::inconvertibleErrorCode(), "the program does not compile"));
+    return module;
+}
+
+template<class Generator>
+static void BM_Optimize(benchmark::State &state, Generator generate) {
+    auto source = generate(state.range(0));
+    auto module = compile(source);
+    // Tuned for the host and its vector math library, as the JIT's own pipeline is.
+    auto jtmb = llvm::orc::KaleidoscopeJIT::createTargetMachineBuilder(
+        llvm::Triple(llvm::sys::getProcessTriple()));
+    auto vec_lib = llvm::orc::KaleidoscopeJIT::loadVectorMathLibrary(jtmb.getTargetTriple());
+    auto optimizer = EXIT_ON_ERROR(llvm::orc::ModuleOptimizer::Create(
+        std::move(jtmb), llvm::orc::ModuleOptimizer::getLevel(state.range(1)), "", vec_lib));
+    auto &original = *module.getModuleUnlocked();
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto copy = llvm::CloneModule(original);
+        state.ResumeTiming();
+        EXIT_ON_ERROR(optimizer->run(*copy));
+        state.PauseTiming();
+        copy.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * original.size());
+}
+
+template<class Generator>
+static void BM_Materialize(benchmark::State &state, Generator generate) {
+    auto source = generate(state.range(0));
+    size_t dylibs = 0, functions = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto module = compile(source);
+        std::vector<std::string> names;
+        for (auto &f : *module.getModuleUnlocked())
+            if (!f.isDeclaration() && !f.hasLocalLinkage()) names.push_back(f.getName().str());
+        functions = names.size();
+        auto &dylib = EXIT_ON_ERROR(THE_JIT->createJITDylib("bench" + std::to_string(dylibs++)));
+        state.ResumeTiming();
+        EXIT_ON_ERROR(THE_JIT->addModule(std::move(module), dylib.getDefaultResourceTracker()));
+        benchmark::DoNotOptimize(EXIT_ON_ERROR(THE_JIT->lookupAll(dylib, names)));
+        state.PauseTiming();
+        EXIT_ON_ERROR(THE_JIT->removeJITDylib(dylib));
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * functions);
+}
+
+#define PHASE(bm, generator, ...) BENCHMARK_CAPTURE(bm, generator, generator)->__VA_ARGS__
+
+PHASE(BM_Lex, deep_expression, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Lex, many_definitions, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Lex, call_chain, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Lex, loop_kernels, RangeMultiplier(8)->Range(64, 4096));
+
+PHASE(BM_Parse, deep_expression, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Parse, many_definitions, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Parse, call_chain, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Parse, loop_kernels, RangeMultiplier(8)->Range(64, 4096));
+
+PHASE(BM_Codegen, deep_expression, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Codegen, many_definitions, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Codegen, call_chain, RangeMultiplier(8)->Range(64, 4096));
+PHASE(BM_Codegen, loop_kernels, RangeMultiplier(8)->Range(64, 4096));
+
+// The pass pipeline at -O1 to -O3 over one module holding every definition.
+PHASE(BM_Optimize, deep_expression, ArgsProduct({{64, 512}, {1, 2, 3}})->Unit(benchmark::kMillisecond));
+PHASE(BM_Optimize, many_definitions, ArgsProduct({{64, 512}, {1, 2, 3}})->Unit(benchmark::kMillisecond));
+PHASE(BM_Optimize, call_chain, ArgsProduct({{64, 512}, {1, 2, 3}})->Unit(benchmark::kMillisecond));
+PHASE(BM_Optimize, loop_kernels, ArgsProduct({{64, 512}, {1, 2, 3}})->Unit(benchmark::kMillisecond));
+
+// Code generation to machine code, linking and looking up every entry point of an unoptimized module.
+PHASE(BM_Materialize, deep_expression, Arg(64)->Arg(512)->Unit(benchmark::kMillisecond));
+PHASE(BM_Materialize, many_definitions, Arg(64)->Arg(512)->Unit(benchmark::kMillisecond));
+PHASE(BM_Materialize, call_chain, Arg(64)->Arg(512)->Unit(benchmark::kMillisecond));
+PHASE(BM_Materialize, loop_kernels, Arg(64)->Arg(512)->Unit(benchmark::kMillisecond));
+
+// Execution of kernels compiled at -O2, called through the pointers Program::get_function returns.
+static const char KERNELS[] = R"(
+extern sin(x);
+def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2);
+def count(n acc) if n < 1 then acc else count(n - 1, acc + n);
+def scale(a[] k) for i = 0, i < len(a) - 1 in a[i] = a[i] * k;
+def norm(a[]) pfor sum i = 0, i < len(a) - 1 in a[i] * a[i];
+def wave(n) pfor sum j = 0, j < n * n in sin(j * 0.001);
+)";
+
+/// kernels - The program KERNELS, compiled on first use.
+static Program &kernels() {
+    static auto program = EXIT_ON_ERROR(Program::compile(*FAST_JIT, KERNELS));
+    return *program;
+}
+
+static void BM_Execute_fib(benchmark::State &state) {
+    auto fib = EXIT_ON_ERROR(kernels().get_function<double(double)>("fib"));
+    for (auto _ : state) benchmark::DoNotOptimize(fib(state.range(0)));
+}
+BENCHMARK(BM_Execute_fib)->DenseRange(10, 25, 5);
+
+static void BM_Execute_count(benchmark::State &state) {
+    auto count = EXIT_ON_ERROR(kernels().get_function<double(double, double)>("count"));
+    for (auto _ : state) benchmark::DoNotOptimize(count(state.range(0), 0));
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Execute_count)->RangeMultiplier(16)->Range(256, 1 << 20);
+
+static void BM_Execute_scale(benchmark::State &state) {
+    auto scale = EXIT_ON_ERROR(kernels().get_function<double(double *, size_t, double)>("scale"));
+    std::vector<double> a(state.range(0), 1);
+    for (auto _ : state) {
+        scale(a.data(), a.size(), 1.0000001);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * a.size() * sizeof(double));
+}
+BENCHMARK(BM_Execute_scale)->RangeMultiplier(16)->Range(256, 1 << 20);
+
+static void BM_Execute_norm(benchmark::State &state) {
+    auto norm = EXIT_ON_ERROR(kernels().get_function<double(double *, size_t)>("norm"));
+    std::vector<double> a(state.range(0), 1);
+    for (auto _ : state) benchmark::DoNotOptimize(norm(a.data(), a.size()));
+    state.SetBytesProcessed(state.iterations() * a.size() * sizeof(double));
+}
+BENCHMARK(BM_Execute_norm)->RangeMultiplier(16)->Range(256, 1 << 20)->UseRealTime();
+
+static void BM_Execute_wave(benchmark::State &state) {
+    auto wave = EXIT_ON_ERROR(kernels().get_function<double(double)>("wave"));
+    for (auto _ : state) benchmark::DoNotOptimize(wave(state.range(0)));
+    state.SetItemsProcessed(state.iterations() * state.range(0) * state.range(0));
+}
+BENCHMARK(BM_Execute_wave)->RangeMultiplier(4)->Range(16, 256)->UseRealTime();
+
+int main(int argc, char **argv) {
+    // Results go out as JSON, ready for benchmark's compare.py, unless another format is asked for.
+    static char json[] = "--benchmark_format=json";
+    std::vector<char *> args(argv, argv + argc);
+    if (std::none_of(args.begin(), args.end(), [](char *arg) { return !strncmp(arg, "--benchmark_format=", 19); }))
+        args.insert(args.begin() + 1, json);
+    auto count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) return 1;
+
+    THE_JIT = EXIT_ON_ERROR(create_jit());
+    llvm::orc::KaleidoscopeJITOptions fast;
+    fast.OptLevel = 2;
+    FAST_JIT = EXIT_ON_ERROR(create_jit(fast));
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef __PROGRAMS_H__
+#define __PROGRAMS_H__
+
+#include <cstddef>
+#include <string>
+
+// Synthetic programs of a given size, each stressing one shape of input the compiler has to scale with.
+// They only use what every phase accepts, so the same source can be lexed, parsed, compiled and run.
+
+/// deep_expression - One definition whose body is a single expression of n binary operators,
+/// with a parenthesized group opened every few operators, up to 32 deep.
+inline std::string deep_expression(size_t n) {
+    static const char ops[] = {'+', '-', '*', '<'};
+    std::string source = "def deep(x y) ";
+    size_t open = 0;
+    for (size_t i = 0; i < n; ++i) {
+        source += i % 3 ? "x " : "y ";
+        source += ops[i % 4];
+        source += ' ';
+        if (i % 5 == 4 && open < 32) {
+            source += '(';
+            ++open;
+        }
+    }
+    source += '1';
+    source.append(open, ')');
+    source += ";\n";
+    return source;
+}
+
+/// many_definitions - n small definitions calling nothing, each with a branch and a few operators.
+inline std::string many_definitions(size_t n) {
+    std::string source;
+    for (size_t i = 0; i < n; ++i) {
+        auto k = std::to_string(i);
+        source += "def f" + k + "(a b) if a < b then a * " + k + " + b else (a - b) * 0.5 + " + k + ";\n";
+    }
+    return source;
+}
+
+/// call_chain - n definitions, each calling the one before, and a top-level call to the last.
+inline std::string call_chain(size_t n) {
+    std::string source = "def c0(x) x + 1;\n";
+    for (size_t i = 1; i < n; ++i)
+        source += "def c" + std::to_string(i) + "(x) c" + std::to_string(i - 1) + "(x * 0.5 + " +
+                  std::to_string(i) + ") - x;\n";
+    source += "c" + std::to_string(n - 1) + "(1);\n";
+    return source;
+}
+
+/// loop_kernels - n definitions of loops, in turn over a buffer, reducing one in parallel,
+/// nested around a call, and counted over a parameter.
+inline std::string loop_kernels(size_t n) {
+    std::string source = "extern sin(x);\n";
+    for (size_t i = 0; i < n; ++i) {
+        auto k = std::to_string(i);
+        switch (i % 4) {
+            case 0:
+                source += "def scale" + k + "(a[] s) for j = 0, j < len(a) - 1 in a[j] = a[j] * s + " + k + ";\n";
+                break;
+            case 1:
+                source += "def norm" + k + "(a[]) pfor sum j = 0, j < len(a) - 1 in a[j] * a[j];\n";
+                break;
+            case 2:
+                source += "def wave" + k + "(n) for j = 0, j < n in for l = 0, l < n in sin(j * l + " + k + ");\n";
+                break;
+            default:
+                source += "def peak" + k + "(a[] b[]) pfor max j = 0, j < len(a) - 1 in a[j] - b[j];\n";
+                break;
+        }
+    }
+    return source;
+}
+
+#endif// __PROGRAMS_H__
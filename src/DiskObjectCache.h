@@ -0,0 +1,99 @@
+//===- DiskObjectCache.h - An object cache kept in a directory --*- C++ -*-===//
+//
+// Keeps the objects the JIT compiles in a local directory, so later runs load
+// them instead of running codegen again.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_DISKOBJECTCACHE_H
+#define LLVM_EXECUTIONENGINE_ORC_DISKOBJECTCACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+#include <string>
+
+namespace llvm ::orc {
+    /// Stores every object compiled from a module in Dir, named after a hash of the module's bitcode
+    /// and of the target it was compiled for: triple, CPU, features, codegen level and LLVM version.
+    /// A module seen before, even by an earlier process, is then loaded without running codegen.
+    /// Objects are written to a temporary file first and renamed, so processes can share a directory.
+    class DiskObjectCache : public ObjectCache {
+        std::string Dir;
+        std::string Target;
+
+        std::mutex Mutex;
+        DenseMap<const Module *, std::string> Missed;// path of each module being compiled after a miss
+
+    public:
+        DiskObjectCache(std::string Dir, const JITTargetMachineBuilder &JTMB, CodeGenOpt::Level OptLevel)
+            : Dir(std::move(Dir)) {
+            raw_string_ostream OS(Target);
+            OS << JTMB.getTargetTriple().str() << ';' << JTMB.getCPU() << ';'
+               << JTMB.getFeatures().getString() << ";O" << static_cast<int>(OptLevel)
+               << ";LLVM " << LLVM_VERSION_STRING;
+        }
+
+        std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+            auto Path = pathFor(*M);
+            if (auto Obj = MemoryBuffer::getFile(Path, false, false)) return std::move(*Obj);
+
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Missed[M] = std::move(Path);
+            return nullptr;
+        }
+
+        void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+            std::string Path;
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                auto It = Missed.find(M);
+                if (It == Missed.end()) return;
+                Path = std::move(It->second);
+                Missed.erase(It);
+            }
+
+            // A failure to store only costs a later run the compilation.
+            int FD;
+            SmallString<128> Temp;
+            if (sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, Temp)) return;
+            bool Failed;
+            {
+                raw_fd_ostream OS(FD, true);
+                OS << Obj.getBuffer();
+                OS.close();
+                Failed = OS.has_error();
+                OS.clear_error();
+            }
+            if (Failed || sys::fs::rename(Temp, Path)) sys::fs::remove(Temp);
+        }
+
+    private:
+        std::string pathFor(const Module &M) {
+            SmallVector<char, 0> Bitcode;
+            raw_svector_ostream OS(Bitcode);
+            WriteBitcodeToFile(M, OS);
+
+            SHA1 Hasher;
+            Hasher.update(Target);
+            Hasher.update(StringRef(Bitcode.data(), Bitcode.size()));
+
+            SmallString<128> Path(Dir);
+            sys::path::append(Path, toHex(Hasher.final(), true) + ".o");
+            return std::string(Path);
+        }
+    };
+}// namespace llvm::orc
+
+#endif// LLVM_EXECUTIONENGINE_ORC_DISKOBJECTCACHE_H
@@ -0,0 +1,82 @@
+//===- InFlightObjectLayer.h - Work still going on for each JITDylib -*- C++ -*-===//
+//
+// Forwards objects to another object layer, keeping count of those still being emitted
+// for each JITDylib, so a JITDylib can be removed once its own work is done, without waiting for anyone else's.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_INFLIGHTOBJECTLAYER_H
+#define LLVM_EXECUTIONENGINE_ORC_INFLIGHTOBJECTLAYER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/Layer.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace llvm ::orc {
+    /// A lookup returns as soon as its symbols are emitted, while the task that emitted them is still
+    /// in the linking layer, using the memory manager, the resource tracker and the JITDylib of the object.
+    /// That task may not even be the one that called emit: an object waiting on the symbols of another
+    /// is finished by whatever task resolves them. Base holds on to the object until it is done with it,
+    /// so each object is counted for its JITDylib until Base frees it,
+    /// and removing a JITDylib only has to wait until the count of its objects is back to 0.
+    /// Other work for a JITDylib, like recompiling one of its functions, is counted with begin and end.
+    class InFlightObjectLayer : public ObjectLayer {
+        /// An object, ending its count when freed.
+        class CountedBuffer : public MemoryBuffer {
+            std::unique_ptr<MemoryBuffer> O;
+            InFlightObjectLayer &Layer;
+            JITDylib &JD;
+
+        public:
+            CountedBuffer(std::unique_ptr<MemoryBuffer> O, InFlightObjectLayer &Layer, JITDylib &JD)
+                : O(std::move(O)), Layer(Layer), JD(JD) {
+                init(this->O->getBufferStart(), this->O->getBufferEnd(), false);
+            }
+            ~CountedBuffer() override { Layer.end(JD); }
+
+            StringRef getBufferIdentifier() const override { return O->getBufferIdentifier(); }
+            BufferKind getBufferKind() const override { return O->getBufferKind(); }
+        };
+
+        ObjectLayer &Base;
+        std::mutex Mutex;
+        std::condition_variable Done;
+        DenseMap<JITDylib *, size_t> InFlight;
+
+    public:
+        InFlightObjectLayer(ExecutionSession &ES, ObjectLayer &Base) : ObjectLayer(ES), Base(Base) {}
+
+        void emit(std::unique_ptr<MaterializationResponsibility> R, std::unique_ptr<MemoryBuffer> O) override {
+            auto &JD = R->getTargetJITDylib();
+            begin(JD);
+            Base.emit(std::move(R), std::make_unique<CountedBuffer>(std::move(O), *this, JD));
+        }
+
+        /// Count one more piece of work for JD.
+        void begin(JITDylib &JD) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            ++InFlight[&JD];
+        }
+
+        /// Count one piece of work for JD as done.
+        void end(JITDylib &JD) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            auto It = InFlight.find(&JD);
+            if (--It->second) return;
+            InFlight.erase(It);
+            Done.notify_all();
+        }
+
+        /// Wait until no work for JD is going on.
+        void wait(JITDylib &JD) {
+            std::unique_lock<std::mutex> Lock(Mutex);
+            Done.wait(Lock, [&] { return !InFlight.count(&JD); });
+        }
+    };
+}// namespace llvm::orc
+
+#endif// LLVM_EXECUTIONENGINE_ORC_INFLIGHTOBJECTLAYER_H
@@ -0,0 +1,97 @@
+//===- JITMemoryUsage.h - Bytes of JIT'd code and data per JITDylib -*- C++ -*-===//
+//
+// Keeps count of the code and data the JIT has loaded into each JITDylib,
+// following resource trackers as they are removed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_JITMEMORYUSAGE_H
+#define LLVM_EXECUTIONENGINE_ORC_JITMEMORYUSAGE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/Object/ObjectFile.h"
+#include <cstdint>
+#include <mutex>
+
+namespace llvm ::orc {
+    /// Bytes of code and data loaded from object files.
+    struct MemoryUsage {
+        uint64_t Code = 0;
+        uint64_t Data = 0;
+    };
+
+    /// Counts the sections of every object the linking layer loads, against the resource tracker
+    /// and the JITDylib it was loaded for. Removing a tracker frees its objects, and takes them off the count,
+    /// so a JITDylib's usage is what it really holds: it stays flat in a session that removes what it is done with.
+    class JITMemoryUsage : public ResourceManager {
+        struct Owned {
+            JITDylib *JD;
+            MemoryUsage Usage;
+        };
+
+        ExecutionSession &ES;
+        std::mutex Mutex;
+        DenseMap<ResourceKey, Owned> ByKey;
+        DenseMap<JITDylib *, MemoryUsage> ByJD;
+
+    public:
+        explicit JITMemoryUsage(ExecutionSession &ES) : ES(ES) { ES.registerResourceManager(*this); }
+        ~JITMemoryUsage() override { ES.deregisterResourceManager(*this); }
+
+        /// Count the allocated sections of Obj, just loaded for R.
+        void notifyLoaded(MaterializationResponsibility &R, const object::ObjectFile &Obj) {
+            MemoryUsage Loaded;
+            for (auto &S : Obj.sections()) {
+                if (S.isText())
+                    Loaded.Code += S.getSize();
+                else if (S.isData() || S.isBSS())
+                    Loaded.Data += S.getSize();
+            }
+
+            auto &JD = R.getTargetJITDylib();
+            // Trackers are only removed once the objects of their JITDylib are emitted, see InFlightObjectLayer.
+            auto Err = R.withResourceKeyDo([&](ResourceKey K) {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                auto &Owner = ByKey.try_emplace(K, Owned{&JD, {}}).first->second;
+                Owner.Usage.Code += Loaded.Code;
+                Owner.Usage.Data += Loaded.Data;
+                auto &Total = ByJD[&JD];
+                Total.Code += Loaded.Code;
+                Total.Data += Loaded.Data;
+            });
+            if (Err) ES.reportError(std::move(Err));
+        }
+
+        MemoryUsage getUsage(JITDylib &JD) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            return ByJD.lookup(&JD);
+        }
+
+        Error handleRemoveResources(ResourceKey K) override {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            auto It = ByKey.find(K);
+            if (It == ByKey.end()) return Error::success();
+            auto Total = ByJD.find(It->second.JD);
+            Total->second.Code -= It->second.Usage.Code;
+            Total->second.Data -= It->second.Usage.Data;
+            // Nothing is left of a removed JITDylib, and one created at its address later starts from 0.
+            if (!Total->second.Code && !Total->second.Data) ByJD.erase(Total);
+            ByKey.erase(It);
+            return Error::success();
+        }
+
+        void handleTransferResources(ResourceKey DstK, ResourceKey SrcK) override {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            auto It = ByKey.find(SrcK);
+            if (It == ByKey.end()) return;
+            auto Src = It->second;
+            ByKey.erase(It);
+            auto &Dst = ByKey.try_emplace(DstK, Owned{Src.JD, {}}).first->second;
+            Dst.Usage.Code += Src.Usage.Code;
+            Dst.Usage.Data += Src.Usage.Data;
+        }
+    };
+}// namespace llvm::orc
+
+#endif// LLVM_EXECUTIONENGINE_ORC_JITMEMORYUSAGE_H
@@ -13,80 +13,519 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "DiskObjectCache.h"
+#include "InFlightObjectLayer.h"
+#include "JITMemoryUsage.h"
+#include "ModuleOptimizer.h"
+#include "SlabMemoryManager.h"
+#include "runtime.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace llvm ::orc {
+    /// Runs ORC tasks, such as compiling and linking a module, on a fixed pool of threads.
+    /// Independent modules are then materialized in parallel,
+    /// while a lookup only waits for the symbols it asked for.
+    class ThreadPoolTaskDispatcher : public TaskDispatcher {
+        ThreadPool Pool;
+
+    public:
+        explicit ThreadPoolTaskDispatcher(unsigned NumThreads)
+            : Pool(hardware_concurrency(NumThreads)) {}
+
+        void dispatch(std::unique_ptr<Task> T) override {
+            // ThreadPool only takes copyable jobs.
+            Pool.async([T = std::shared_ptr<Task>(std::move(T))] { T->run(); });
+        }
+
+        void shutdown() override { Pool.wait(); }
+    };
+
+    /// Settings a KaleidoscopeJIT is created with.
+    struct KaleidoscopeJITOptions {
+        /// Threads compiling modules, 0 to compile on the thread that looks a symbol up.
+        unsigned NumCompileThreads = 0;
+        /// Optimization level, 0 to 3, of the default pipeline run over every module before it is compiled.
+        unsigned OptLevel = 0;
+        /// Pipeline run instead of the default one if not empty, in the textual form `opt -passes=` takes.
+        std::string Passes;
+        /// Compile each function only when it is first called.
+        bool Lazy = false;
+        /// Compile each module without any pass on its first call, then recompile every function
+        /// called HotThreshold times at TierUpLevel in the background. Takes precedence over Lazy.
+        bool Tiered = false;
+        uint64_t HotThreshold = 1000;
+        unsigned TierUpLevel = 2;
+        /// Directory keeping compiled objects across runs, none if empty.
+        std::string CacheDir;
+        /// Bytes of each part of the slabs objects are loaded into, 0 to give every object pages of its own.
+        /// Only Linux has slabs, elsewhere every object has pages of its own anyway.
+        size_t SlabSize = 4 << 20;
+        /// Let the loop vectorizer call the vector math library of the host, if there is one.
+        bool VectorMath = true;
+        /// CPU to compile for, like skylake-avx512, the host's if empty.
+        std::string CPU;
+        /// Features to turn on or off over those of the CPU, like +avx2,-avx512f.
+        std::string Features;
+    };
+
     class KaleidoscopeJIT {
+        /// A function compiled by a tiered JIT: callers reach it through the stub named Name,
+        /// which points at its unoptimized body until it is hot.
+        struct TieredFunction {
+            std::string Name;
+            JITDylib &JD;
+            IndirectStubsManager &Stubs;
+            std::shared_ptr<ThreadSafeModule> Source;// IR as it was added, shared by the module's functions
+            std::atomic<bool> TierUpRequested{false};
+
+            TieredFunction(std::string Name, JITDylib &JD, IndirectStubsManager &Stubs,
+                           std::shared_ptr<ThreadSafeModule> Source)
+                : Name(std::move(Name)), JD(JD), Stubs(Stubs), Source(std::move(Source)) {}
+        };
+
+        /// The functions a tiered JIT added to one JITDylib.
+        struct TieredDylib {
+            std::unique_ptr<IndirectStubsManager> Stubs;// stub names are per JITDylib
+            StringSet<> Names;// names of the tier-0 bodies' functions, as other modules declare them
+            std::vector<uint64_t> Ids;// of its TieredFunctions
+        };
+
         std::unique_ptr<ExecutionSession> ES;
 
         DataLayout DL;
         MangleAndInterner Mangle;
 
+        std::unique_ptr<LazyCallThroughManager> LCTMgr;
+        std::unique_ptr<DiskObjectCache> Cache, BaselineCache;
+        JITMemoryUsage Usage;
+        std::unique_ptr<SlabMemoryPool> Slabs;
         RTDyldObjectLinkingLayer ObjectLayer;
+        InFlightObjectLayer InFlight;// what is still being emitted for each JITDylib
         IRCompileLayer CompileLayer;
+        IRTransformLayer OptimizeLayer;
+        std::unique_ptr<CompileOnDemandLayer> CODLayer;
+
+        std::unique_ptr<ModuleOptimizer> Optimizer;// null if modules are compiled as they are
+
+        // Tiered compilation, only set up in a tiered JIT.
+        uint64_t HotThreshold;
+        std::unique_ptr<ModuleOptimizer> TierUpOptimizer;
+        std::unique_ptr<IRCompileLayer> BaselineLayer;// tier 0, with the fastest instruction selection
+        std::function<std::unique_ptr<IndirectStubsManager>()> CreateStubs;
+        std::unique_ptr<ThreadPool> TierUpPool;
+        std::mutex TieredMutex;
+        DenseMap<uint64_t, std::unique_ptr<TieredFunction>> TieredFunctions;// by the id its tier-0 body passes the hook
+        uint64_t NextTieredId = 0;
+        DenseMap<JITDylib *, TieredDylib> TieredDylibs;
 
         JITDylib &MainJD;
 
     public:
+        /// String attribute of the functions that run once, which a tiered JIT does not instrument.
+        /// Unlike cold, it leaves how the function is optimized and laid out alone.
+        static constexpr const char *TopLevelAttribute = "kaleido-top-level";
+
+        /// A null LCTMgr compiles every module as soon as one of its symbols is looked up,
+        /// otherwise each function is compiled only when it is first called, or tiered if Opts asks to.
         KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
                         JITTargetMachineBuilder JTMB,
-                        DataLayout DL)
+                        DataLayout DL,
+                        const KaleidoscopeJITOptions &Opts = {},
+                        std::unique_ptr<LazyCallThroughManager> LCTMgr = nullptr,
+                        std::unique_ptr<ModuleOptimizer> Optimizer = nullptr,
+                        std::unique_ptr<ModuleOptimizer> TierUpOptimizer = nullptr)
             : ES(std::move(ES)),
               DL(std::move(DL)),
               Mangle(*this->ES, this->DL),
-              ObjectLayer(*this->ES, []() { return std::make_unique<SectionMemoryManager>(); }),
-              CompileLayer(*this->ES, ObjectLayer, std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+              LCTMgr(std::move(LCTMgr)),
+              Cache(Opts.CacheDir.empty() ? nullptr : std::make_unique<DiskObjectCache>(Opts.CacheDir, JTMB, CodeGenOpt::Default)),
+              Usage(*this->ES),
+              Slabs(Opts.SlabSize && SlabMemoryPool::isSupported() ? std::make_unique<SlabMemoryPool>(Opts.SlabSize) : nullptr),
+              ObjectLayer(*this->ES, [this]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                  if (Slabs) return Slabs->createMemoryManager();
+                  return std::make_unique<SectionMemoryManager>();
+              }),
+              InFlight(*this->ES, ObjectLayer),
+              CompileLayer(*this->ES, InFlight, std::make_unique<ConcurrentIRCompiler>(JTMB, Cache.get())),
+              OptimizeLayer(*this->ES, CompileLayer, [this](ThreadSafeModule TSM, MaterializationResponsibility &) {
+                  return optimizeModule(std::move(TSM));
+              }),
+              Optimizer(std::move(Optimizer)),
+              HotThreshold(Opts.HotThreshold),
+              TierUpOptimizer(std::move(TierUpOptimizer)),
               MainJD(this->ES->createBareJITDylib("<main>")) {
             MainJD.addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
+            // The runtime is linked into this process, which need not export it.
+            cantFail(MainJD.define(absoluteSymbols({
+                {Mangle("__kaleido_parallel_for"),
+                 JITEvaluatedSymbol(pointerToJITTargetAddress(&__kaleido_parallel_for),
+                                    JITSymbolFlags::Exported | JITSymbolFlags::Callable)},
+            })));
             if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
                 ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
                 ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
             }
+            ObjectLayer.setNotifyLoaded([this](MaterializationResponsibility &R, const object::ObjectFile &Obj,
+                                               const RuntimeDyld::LoadedObjectInfo &) { Usage.notifyLoaded(R, Obj); });
+            if (!this->LCTMgr) return;
+            if (!Opts.Tiered) {
+                CODLayer = std::make_unique<CompileOnDemandLayer>(
+                    *this->ES, OptimizeLayer, *this->LCTMgr,
+                    createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple()));
+                return;
+            }
+
+            auto BaselineJTMB = JTMB;
+            BaselineJTMB.setCodeGenOptLevel(CodeGenOpt::None);
+            if (Cache) BaselineCache = std::make_unique<DiskObjectCache>(Opts.CacheDir, BaselineJTMB, CodeGenOpt::None);
+            BaselineLayer = std::make_unique<IRCompileLayer>(
+                *this->ES, InFlight, std::make_unique<ConcurrentIRCompiler>(std::move(BaselineJTMB), BaselineCache.get()));
+            CreateStubs = createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple());
+            // Recompiling waits for the compile threads, so it must not run on one of them.
+            TierUpPool = std::make_unique<ThreadPool>(hardware_concurrency(1));
+            // Tier-0 bodies pass this JIT to the hook, as the address of the context symbol.
+            cantFail(MainJD.define(absoluteSymbols({
+                {Mangle("__kaleido_tier_up"),
+                 JITEvaluatedSymbol(pointerToJITTargetAddress(&tierUpEntry), JITSymbolFlags::Exported | JITSymbolFlags::Callable)},
+                {Mangle("__kaleido_tier_context"),
+                 JITEvaluatedSymbol(pointerToJITTargetAddress(this), JITSymbolFlags::Exported)},
+            })));
         }
 
         ~KaleidoscopeJIT() {
+            // Let recompilations and tasks still finishing a materialization run before the JITDylibs are closed.
+            if (TierUpPool) TierUpPool->wait();
+            ES->getExecutorProcessControl().getDispatcher().shutdown();
             if (auto Err = ES->endSession()) ES->reportError(std::move(Err));
         }
 
-        static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-            auto EPC = SelfExecutorProcessControl::Create();
+        /// Create a JIT compiling on Opts.NumCompileThreads worker threads,
+        /// or on the thread that looks a symbol up if it is 0.
+        /// A Lazy JIT puts a call-through stub in front of every function and compiles it on the first call.
+        /// A Tiered JIT puts one in front of every module, and swaps in optimized bodies for hot functions.
+        /// Objects are looked up in, and stored to, Opts.CacheDir if it is set, which is created if missing.
+        /// Code is tuned for the host CPU, or for Opts.CPU and Opts.Features if they are set.
+        static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(const KaleidoscopeJITOptions &Opts = {}) {
+            if (!Opts.CacheDir.empty())
+                if (auto EC = sys::fs::create_directories(Opts.CacheDir))
+                    return createFileError(Opts.CacheDir, EC);
+
+            auto NumCompileThreads = Opts.NumCompileThreads;
+            std::unique_ptr<TaskDispatcher> D;
+            if (NumCompileThreads) D = std::make_unique<ThreadPoolTaskDispatcher>(NumCompileThreads);
+
+            auto EPC = SelfExecutorProcessControl::Create(nullptr, std::move(D));
             if (!EPC) return EPC.takeError();
 
             auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+#if LLVM_VERSION_MAJOR < 15
+            // Before LLVM 15 the session does not dispatch through the executor's dispatcher by itself.
+            if (NumCompileThreads)
+                ES->setDispatchTask([&D = ES->getExecutorProcessControl().getDispatcher()](std::unique_ptr<Task> T) {
+                    D.dispatch(std::move(T));
+                });
+#endif
 
-            JITTargetMachineBuilder JTMB(ES->getExecutorProcessControl().getTargetTriple());
+            auto JTMB = createTargetMachineBuilder(ES->getExecutorProcessControl().getTargetTriple(), Opts.CPU,
+                                                   Opts.Features);
 
             auto DL = JTMB.getDefaultDataLayoutForTarget();
             if (!DL) return DL.takeError();
 
+            auto VecLib = Opts.VectorMath ? loadVectorMathLibrary(JTMB.getTargetTriple()) : TargetLibraryInfoImpl::NoLibrary;
+            std::unique_ptr<ModuleOptimizer> Optimizer, TierUpOptimizer;
+            if (Opts.OptLevel || !Opts.Passes.empty()) {
+                auto OptimizerOrErr = ModuleOptimizer::Create(JTMB, ModuleOptimizer::getLevel(Opts.OptLevel),
+                                                              Opts.Passes, VecLib);
+                if (!OptimizerOrErr) return OptimizerOrErr.takeError();
+                Optimizer = std::move(*OptimizerOrErr);
+            }
+            if (Opts.Tiered) {
+                auto Level = ModuleOptimizer::getLevel(Opts.TierUpLevel >= 3 ? 3 : 2);
+                auto OptimizerOrErr = ModuleOptimizer::Create(JTMB, Level, "", VecLib);
+                if (!OptimizerOrErr) return OptimizerOrErr.takeError();
+                TierUpOptimizer = std::move(*OptimizerOrErr);
+            }
+
+            std::unique_ptr<LazyCallThroughManager> LCTMgr;
+            if (Opts.Lazy || Opts.Tiered) {
+                auto LCTMgrOrErr = createLocalLazyCallThroughManager(JTMB.getTargetTriple(), *ES, 0);
+                if (!LCTMgrOrErr) return LCTMgrOrErr.takeError();
+                LCTMgr = std::move(*LCTMgrOrErr);
+            }
+
             return std::make_unique<KaleidoscopeJIT>(std::move(ES),
                                                      std::move(JTMB),
-                                                     std::move(*DL));
+                                                     std::move(*DL),
+                                                     Opts,
+                                                     std::move(LCTMgr),
+                                                     std::move(Optimizer),
+                                                     std::move(TierUpOptimizer));
+        }
+
+        /// A builder of target machines for TT, a triple the host runs, that make the most of the host CPU
+        /// unless a CPU is given, with Features turned on or off over those of the CPU.
+        static JITTargetMachineBuilder createTargetMachineBuilder(Triple TT, StringRef CPU = "",
+                                                                  StringRef Features = "") {
+            JITTargetMachineBuilder JTMB(std::move(TT));
+            if (CPU.empty()) {
+                JTMB.setCPU(sys::getHostCPUName().str());
+                StringMap<bool> HostFeatures;
+                if (sys::getHostCPUFeatures(HostFeatures))
+                    for (auto &F : HostFeatures) JTMB.getFeatures().AddFeature(F.first(), F.second);
+            } else
+                JTMB.setCPU(CPU.str());
+            JTMB.addFeatures(SubtargetFeatures(Features).getFeatures());
+            return JTMB;
         }
 
         const DataLayout &getDataLayout() const { return DL; }
 
+        /// The JITDylib with the host process' symbols and the JIT's runtime, where modules go by default.
         JITDylib &getMainJITDylib() { return MainJD; }
 
+        /// Create a JITDylib for one client, so its symbols never clash with another's.
+        /// What it does not define itself is looked up in the main JITDylib.
+        Expected<JITDylib &> createJITDylib(std::string Name) {
+            auto JD = ES->createJITDylib(std::move(Name));
+            if (!JD) return JD.takeError();
+            JD->addToLinkOrder(MainJD);
+            return JD;
+        }
+
+        /// Free everything JD holds. None of its code may be running, or run later.
+        /// The emission of its code, and the recompilation of its hot functions, are waited for first,
+        /// but not the work of any other JITDylib.
+        /// In a lazy JIT the functions compiled for it stay in the CompileOnDemandLayer's own JITDylib.
+        Error removeJITDylib(JITDylib &JD) {
+            if (BaselineLayer) {
+                // No hot function of JD may start recompiling once JD is going.
+                std::lock_guard<std::mutex> Lock(TieredMutex);
+                auto TD = TieredDylibs.find(&JD);
+                if (TD != TieredDylibs.end())
+                    for (auto Id : TD->second.Ids) TieredFunctions[Id]->TierUpRequested = true;
+            }
+            InFlight.wait(JD);
+            auto Err = ES->removeJITDylib(JD);
+            if (BaselineLayer) {
+                // Modules lock their context as they die, so they must not die under TieredMutex.
+                std::vector<std::unique_ptr<TieredFunction>> Removed;
+                std::lock_guard<std::mutex> Lock(TieredMutex);
+                auto TD = TieredDylibs.find(&JD);
+                if (TD != TieredDylibs.end()) {
+                    for (auto Id : TD->second.Ids) {
+                        auto TF = TieredFunctions.find(Id);
+                        Removed.push_back(std::move(TF->second));
+                        TieredFunctions.erase(TF);
+                    }
+                    TieredDylibs.erase(TD);
+                }
+            }
+            return Err;
+        }
+
+        /// Free what RT holds, once the emission of code for its JITDylib is done. None of it may be running.
+        Error remove(ResourceTracker &RT) {
+            InFlight.wait(RT.getJITDylib());
+            return RT.remove();
+        }
+
+        /// Bytes of code and data JD holds, that removing its resource trackers would free.
+        MemoryUsage getMemoryUsage(JITDylib &JD) { return Usage.getUsage(JD); }
+
         Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
             if (!RT) RT = MainJD.getDefaultResourceTracker();
-            return CompileLayer.add(RT, std::move(TSM));
+            if (BaselineLayer) return addTieredModule(std::move(TSM), std::move(RT));
+            if (CODLayer) return CODLayer->add(RT, std::move(TSM));
+            return OptimizeLayer.add(RT, std::move(TSM));
+        }
+
+        Expected<JITEvaluatedSymbol> lookup(JITDylib &JD, StringRef Name) {
+            return ES->lookup({&JD}, Mangle(Name.str()));
+        }
+
+        /// Look up many symbols at once, materializing everything they need in one go.
+        Expected<std::vector<JITEvaluatedSymbol>> lookupAll(JITDylib &JD, ArrayRef<std::string> Names) {
+            SymbolLookupSet Symbols;
+            for (auto &Name : Names) Symbols.add(Mangle(Name));
+            auto Result = ES->lookup(makeJITDylibSearchOrder(&JD), std::move(Symbols));
+            if (!Result) return Result.takeError();
+
+            std::vector<JITEvaluatedSymbol> Addrs;
+            for (auto &Name : Names) Addrs.push_back((*Result)[Mangle(Name)]);
+            return Addrs;
+        }
+
+        /// Load the vector math library of the host into the process, where the JIT finds its symbols,
+        /// and tell which one it is. Only glibc's libmvec is known, on x86-64.
+        static TargetLibraryInfoImpl::VectorLibrary loadVectorMathLibrary(const Triple &TT) {
+            if (TT.getArch() != Triple::x86_64 || !TT.isOSLinux()) return TargetLibraryInfoImpl::NoLibrary;
+            if (sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1")) return TargetLibraryInfoImpl::NoLibrary;
+            return TargetLibraryInfoImpl::LIBMVEC_X86;
+        }
+
+    private:
+        /// Add a module to a tiered JIT. Its functions are renamed to their tier-0 bodies, each
+        /// counting its calls, and callers go through lazy stubs that compile the module on first call.
+        /// Functions marked with TopLevelAttribute, top-level expressions that run once, are left alone.
+        Error addTieredModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+            auto &JD = RT->getJITDylib();
+            std::vector<std::string> Names;
+            IndirectStubsManager *Stubs = nullptr;
+            TSM.withModuleDo([&](Module &M) {
+                for (auto &F : M)
+                    if (!F.isDeclaration() && F.hasExternalLinkage() && !F.hasFnAttribute(TopLevelAttribute))
+                        Names.push_back(F.getName().str());
+
+                std::lock_guard<std::mutex> Lock(TieredMutex);
+                auto &TD = TieredDylibs[&JD];
+                for (auto &Name : Names) TD.Names.insert(Name);
+                // Whatever the module calls of JD's functions is counted, here as well as in the IR kept for
+                // tiering up, where calls to the others still go through their stubs.
+                for (auto &F : M)
+                    if (TD.Names.count(F.getName())) dropEffects(F);
+                if (Names.empty()) return;
+
+                auto Source = std::make_shared<ThreadSafeModule>(CloneModule(M), TSM.getContext());
+                if (!TD.Stubs) TD.Stubs = CreateStubs();
+                Stubs = TD.Stubs.get();
+                for (auto &Name : Names) {
+                    auto Id = NextTieredId++;
+                    instrument(M, *M.getFunction(Name), Id);
+                    TieredFunctions[Id] = std::make_unique<TieredFunction>(Name, JD, *Stubs, Source);
+                    TD.Ids.push_back(Id);
+                }
+            });
+
+            if (!Names.empty()) {
+                SymbolAliasMap Aliases;
+                for (auto &Name : Names)
+                    Aliases[Mangle(Name)] = SymbolAliasMapEntry(Mangle(Name + "$t0"),
+                                                                JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+                if (auto Err = JD.define(lazyReexports(*LCTMgr, *Stubs, JD, std::move(Aliases)), RT))
+                    return Err;
+            }
+            return BaselineLayer->add(RT, std::move(TSM));
+        }
+
+        /// Take back what F, and every call to it, claim about memory and speculation.
+        /// A tier-0 body writes its count, and reaching the hook is a call with effects of its own,
+        /// so no call to it may be dropped, merged or hoisted.
+        static void dropEffects(Function &F) {
+            static const Attribute::AttrKind Kinds[] = {Attribute::ReadNone, Attribute::ReadOnly,
+                                                        Attribute::ArgMemOnly, Attribute::Speculatable};
+            for (auto Kind : Kinds) F.removeFnAttr(Kind);
+            for (auto *U : F.users())
+                if (auto *Call = dyn_cast<CallBase>(U))
+                    for (auto Kind : Kinds) Call->removeFnAttr(Kind);
+        }
+
+        /// Rename F to its tier-0 body, send its callers to the stub now owning its name,
+        /// and count its calls, calling the tier-up hook on the HotThreshold-th.
+        /// Calls on several threads at once are all counted, and exactly one of them calls the hook.
+        void instrument(Module &M, Function &F, uint64_t Id) {
+            auto Name = F.getName().str();
+            F.setName(Name + "$t0");
+            auto Stub = Function::Create(F.getFunctionType(), Function::ExternalLinkage, Name, M);
+            Stub->setCallingConv(F.getCallingConv());
+            F.replaceAllUsesWith(Stub);
+
+            auto &Ctx = M.getContext();
+            auto I64 = Type::getInt64Ty(Ctx);
+            auto Count = new GlobalVariable(M, I64, false, GlobalValue::InternalLinkage,
+                                            ConstantInt::get(I64, 0), Name + "$count");
+            auto Context = M.getOrInsertGlobal("__kaleido_tier_context", Type::getInt8Ty(Ctx));
+            auto Hook = M.getOrInsertFunction("__kaleido_tier_up", Type::getVoidTy(Ctx), Context->getType(), I64);
+
+            auto Entry = &F.getEntryBlock();
+            auto CountBB = BasicBlock::Create(Ctx, "count", &F, Entry);
+            auto HotBB = BasicBlock::Create(Ctx, "hot", &F, Entry);
+            IRBuilder<> B(CountBB);
+            auto Calls = B.CreateAtomicRMW(AtomicRMWInst::Add, Count, ConstantInt::get(I64, 1), MaybeAlign(8),
+                                           AtomicOrdering::Monotonic);
+            B.CreateCondBr(B.CreateICmpEQ(Calls, ConstantInt::get(I64, HotThreshold - 1)), HotBB, Entry);
+            B.SetInsertPoint(HotBB);
+            B.CreateCall(Hook, {Context, ConstantInt::get(I64, Id)});
+            B.CreateBr(Entry);
+        }
+
+        /// Called by a tier-0 body the moment it becomes hot. Returns at once, recompiling in the background.
+        static void tierUpEntry(KaleidoscopeJIT *JIT, uint64_t Id) {
+            TieredFunction *TF;
+            {
+                // Counted as work for its JITDylib before removeJITDylib can look, so the JITDylib waits for it.
+                std::lock_guard<std::mutex> Lock(JIT->TieredMutex);
+                auto It = JIT->TieredFunctions.find(Id);
+                if (It == JIT->TieredFunctions.end()) return;
+                TF = It->second.get();
+                if (TF->TierUpRequested.exchange(true)) return;
+                JIT->InFlight.begin(TF->JD);
+            }
+            JIT->TierUpPool->async([JIT, TF] {
+                if (auto Err = JIT->tierUp(*TF)) JIT->ES->reportError(std::move(Err));
+                JIT->InFlight.end(TF->JD);
+            });
+        }
+
+        /// Optimize a hot function on its own, its calls to others still going through their stubs,
+        /// and point its stub at the result.
+        Error tierUp(TieredFunction &TF) {
+            auto Hot = TF.Name + "$t2";
+            auto TSM = TF.Source->withModuleDo([&](Module &M) -> Expected<ThreadSafeModule> {
+                ValueToValueMapTy VMap;
+                // Bodies imported for inlining, and internal ones nothing else could reach, such as outlined loop
+                // bodies, come along. Everything else is called through its stub.
+                auto Clone = CloneModule(M, VMap, [&](const GlobalValue *GV) {
+                    return GV->getName() == TF.Name || GV->hasAvailableExternallyLinkage() || GV->hasLocalLinkage();
+                });
+                Clone->getFunction(TF.Name)->setName(Hot);
+                if (auto Err = TierUpOptimizer->run(*Clone)) return Err;
+                return ThreadSafeModule(std::move(Clone), TF.Source->getContext());
+            });
+            if (!TSM) return TSM.takeError();
+
+            if (auto Err = CompileLayer.add(TF.JD, std::move(*TSM))) return Err;
+            auto Body = lookup(TF.JD, Hot);
+            if (!Body) return Body.takeError();
+            return TF.Stubs.updatePointer(*Mangle(TF.Name), Body->getAddress());
         }
 
-        Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-            return ES->lookup({&MainJD}, Mangle(Name.str()));
+        /// Optimize a module right before it is compiled,
+        /// so in a lazy JIT only the functions that get called are ever optimized.
+        Expected<ThreadSafeModule> optimizeModule(ThreadSafeModule TSM) {
+            if (!Optimizer) return TSM;
+            if (auto Err = TSM.withModuleDo([this](Module &M) { return Optimizer->run(M); })) return Err;
+            return TSM;
         }
     };
 }// namespace llvm::orc
@@ -0,0 +1,137 @@
+//===- ModuleOptimizer.h - A reusable new pass manager pipeline -*- C++ -*-===//
+//
+// Runs an optimization pipeline built with PassBuilder over the modules the
+// JIT compiles, from any number of threads.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_MODULEOPTIMIZER_H
+#define LLVM_EXECUTIONENGINE_ORC_MODULEOPTIMIZER_H
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm ::orc {
+    /// Optimizes modules with either the default pipeline of an optimization level,
+    /// or a pipeline given in the textual form `opt -passes=` takes.
+    /// Analysis managers are not thread-safe, so each thread running the pipeline borrows an instance:
+    /// a target machine, the four analysis managers and the pass pipeline, all built once.
+    /// An instance forgets every analysis after a run, since the next module is a different one.
+    /// A vector library tells the loop vectorizer which math functions have vector variants it may call.
+    class ModuleOptimizer {
+        struct Instance {
+            std::unique_ptr<TargetMachine> TM;
+            TargetLibraryInfoImpl TLII;
+            LoopAnalysisManager LAM;
+            FunctionAnalysisManager FAM;
+            CGSCCAnalysisManager CGAM;
+            ModuleAnalysisManager MAM;
+            PassBuilder PB;
+            ModulePassManager MPM;
+
+            Instance(std::unique_ptr<TargetMachine> TM, TargetLibraryInfoImpl::VectorLibrary VecLib)
+                : TM(std::move(TM)), TLII(this->TM->getTargetTriple()), PB(this->TM.get()) {
+                TLII.addVectorizableFunctionsFromVecLib(VecLib);
+                // Registered first, so it is kept over the default one PassBuilder would register.
+                FAM.registerPass([this] { return TargetLibraryAnalysis(TLII); });
+                PB.registerModuleAnalyses(MAM);
+                PB.registerCGSCCAnalyses(CGAM);
+                PB.registerFunctionAnalyses(FAM);
+                PB.registerLoopAnalyses(LAM);
+                PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+            }
+        };
+
+        JITTargetMachineBuilder JTMB;
+        OptimizationLevel Level;
+        std::string Pipeline;
+        TargetLibraryInfoImpl::VectorLibrary VecLib;
+
+        std::mutex Mutex;
+        std::vector<std::unique_ptr<Instance>> Idle;
+
+        ModuleOptimizer(JITTargetMachineBuilder JTMB, OptimizationLevel Level, std::string Pipeline,
+                        TargetLibraryInfoImpl::VectorLibrary VecLib)
+            : JTMB(std::move(JTMB)), Level(Level), Pipeline(std::move(Pipeline)), VecLib(VecLib) {}
+
+        Expected<std::unique_ptr<Instance>> createInstance() {
+            auto TM = JTMB.createTargetMachine();
+            if (!TM) return TM.takeError();
+
+            auto I = std::make_unique<Instance>(std::move(*TM), VecLib);
+            if (!Pipeline.empty()) {
+                if (auto Err = I->PB.parsePassPipeline(I->MPM, Pipeline)) return Err;
+            } else if (Level == OptimizationLevel::O0) {
+                I->MPM = I->PB.buildO0DefaultPipeline(Level);
+            } else {
+                I->MPM = I->PB.buildPerModuleDefaultPipeline(Level);
+            }
+            return I;
+        }
+
+    public:
+        /// Create an optimizer running Pipeline, or the default pipeline of Level if Pipeline is empty.
+        /// A first instance is built right away, so a pipeline that does not parse is reported here.
+        static Expected<std::unique_ptr<ModuleOptimizer>> Create(
+            JITTargetMachineBuilder JTMB, OptimizationLevel Level, std::string Pipeline = "",
+            TargetLibraryInfoImpl::VectorLibrary VecLib = TargetLibraryInfoImpl::NoLibrary) {
+            auto Optimizer = std::unique_ptr<ModuleOptimizer>(
+                new ModuleOptimizer(std::move(JTMB), Level, std::move(Pipeline), VecLib));
+            auto I = Optimizer->createInstance();
+            if (!I) return I.takeError();
+            Optimizer->Idle.push_back(std::move(*I));
+            return Optimizer;
+        }
+
+        /// The optimization level of the default pipeline, 0 to 3.
+        static OptimizationLevel getLevel(unsigned Level) {
+            switch (Level) {
+                case 0:
+                    return OptimizationLevel::O0;
+                case 1:
+                    return OptimizationLevel::O1;
+                case 2:
+                    return OptimizationLevel::O2;
+                default:
+                    return OptimizationLevel::O3;
+            }
+        }
+
+        Error run(Module &M) {
+            std::unique_ptr<Instance> I;
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                if (!Idle.empty()) {
+                    I = std::move(Idle.back());
+                    Idle.pop_back();
+                }
+            }
+            if (!I) {
+                auto New = createInstance();
+                if (!New) return New.takeError();
+                I = std::move(*New);
+            }
+
+            I->MPM.run(M, I->MAM);
+            I->LAM.clear();
+            I->FAM.clear();
+            I->CGAM.clear();
+            I->MAM.clear();
+
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Idle.push_back(std::move(I));
+            return Error::success();
+        }
+    };
+}// namespace llvm::orc
+
+#endif// LLVM_EXECUTIONENGINE_ORC_MODULEOPTIMIZER_H
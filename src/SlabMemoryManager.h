@@ -0,0 +1,308 @@
+//===- SlabMemoryManager.h - JIT memory packed into shared slabs -*- C++ -*-===//
+//
+// Gives the sections of every object the JIT loads room in a few large slabs,
+// instead of fresh pages for each object.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+#define LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace llvm ::orc {
+    /// A pool of slabs, each split in three parts: code, read-only data and read-write data.
+    /// A slab is a memory file mapped twice: once writable, where sections are loaded and relocated,
+    /// and once with the protection of each part, where they run. Objects loaded later can then share
+    /// the pages of code already running, without ever making a page writable and executable,
+    /// and without an mmap or mprotect per object.
+    /// The sections of one object all come from one slab, so they are always close enough to reach each other.
+    /// Slabs are memory files, made with memfd_create, so only Linux has them: see isSupported.
+    class SlabMemoryPool {
+    public:
+        enum Part { Code,
+                    ROData,
+                    RWData };
+
+        struct Slab {
+            int FD = -1;
+            char *Write = nullptr;// every part, read-write
+            char *Exec = nullptr; // every part with its own protection
+            size_t PartSize = 0;
+            std::array<std::map<size_t, size_t>, 3> Free;// free ranges of each part, offset to size
+        };
+
+        /// A range of one part of a slab.
+        /// A block of size 0 has no room, but still tells which slab the other blocks of its object are in.
+        struct Block {
+            Slab *S = nullptr;
+            Part P = Code;
+            size_t Offset = 0, Size = 0;
+
+            char *write() const { return S->Write + P * S->PartSize + Offset; }
+            char *exec() const { return S->Exec + P * S->PartSize + Offset; }
+        };
+
+    private:
+        size_t SlabSize;// bytes of each part of a new slab
+        std::mutex Mutex;
+        std::vector<std::unique_ptr<Slab>> Slabs;
+
+        static bool take(Slab &S, Part P, size_t Size, size_t Align, Block &B) {
+            B = {};
+            if (!Size) {
+                B = {&S, P, 0, 0};
+                return true;
+            }
+            auto &Free = S.Free[P];
+            for (auto It = Free.begin(); It != Free.end(); ++It) {
+                auto Begin = It->first, End = It->first + It->second;
+                auto Start = alignTo(Begin, Align);
+                if (Start + Size > End) continue;
+                Free.erase(It);
+                if (Begin < Start) Free.emplace(Begin, Start - Begin);
+                if (Start + Size < End) Free.emplace(Start + Size, End - Start - Size);
+                B = {&S, P, Start, Size};
+                return true;
+            }
+            return false;
+        }
+
+        static void give(const Block &B) {
+            if (!B.S || !B.Size) return;
+            auto &Free = B.S->Free[B.P];
+            auto Begin = B.Offset, End = B.Offset + B.Size;
+            auto Next = Free.lower_bound(Begin);
+            if (Next != Free.end() && Next->first == End) {
+                End += Next->second;
+                Next = Free.erase(Next);
+            }
+            if (Next != Free.begin()) {
+                auto Prev = std::prev(Next);
+                if (Prev->first + Prev->second == Begin) {
+                    Begin = Prev->first;
+                    Free.erase(Prev);
+                }
+            }
+            Free.emplace(Begin, End - Begin);
+        }
+
+        static Error errnoError() { return errorCodeToError(std::error_code(errno, std::generic_category())); }
+
+        Expected<Slab *> createSlab(size_t PartSize) {
+#ifndef __linux__
+            return make_error<StringError>("JIT slabs are not supported on this platform", inconvertibleErrorCode());
+#else
+            auto S = std::make_unique<Slab>();
+            S->PartSize = PartSize;
+            auto Total = 3 * PartSize;
+            S->FD = memfd_create("kaleidoscope-jit", MFD_CLOEXEC);
+            if (S->FD < 0) return errnoError();
+            if (ftruncate(S->FD, Total) != 0) {
+                close(S->FD);
+                return errnoError();
+            }
+            auto W = mmap(nullptr, Total, PROT_READ | PROT_WRITE, MAP_SHARED, S->FD, 0);
+            auto X = W == MAP_FAILED ? MAP_FAILED : mmap(nullptr, Total, PROT_NONE, MAP_SHARED, S->FD, 0);
+            if (X == MAP_FAILED) {
+                auto Err = errnoError();
+                if (W != MAP_FAILED) munmap(W, Total);
+                close(S->FD);
+                return Err;
+            }
+            S->Write = static_cast<char *>(W);
+            S->Exec = static_cast<char *>(X);
+            if (mprotect(S->Exec + Code * PartSize, PartSize, PROT_READ | PROT_EXEC) != 0 ||
+                mprotect(S->Exec + ROData * PartSize, PartSize, PROT_READ) != 0 ||
+                mprotect(S->Exec + RWData * PartSize, PartSize, PROT_READ | PROT_WRITE) != 0) {
+                auto Err = errnoError();
+                destroy(*S);
+                return Err;
+            }
+            for (auto &Free : S->Free) Free.emplace(0, PartSize);
+            Slabs.push_back(std::move(S));
+            return Slabs.back().get();
+#endif
+        }
+
+        static void destroy(Slab &S) {
+#ifdef __linux__
+            munmap(S.Write, 3 * S.PartSize);
+            munmap(S.Exec, 3 * S.PartSize);
+            close(S.FD);
+#endif
+        }
+
+    public:
+        explicit SlabMemoryPool(size_t SlabSize)
+            : SlabSize(alignTo(SlabSize, sys::Process::getPageSizeEstimate())) {}
+        ~SlabMemoryPool() {
+            for (auto &S : Slabs) destroy(*S);
+        }
+        SlabMemoryPool(const SlabMemoryPool &) = delete;
+        SlabMemoryPool &operator=(const SlabMemoryPool &) = delete;
+
+        /// Whether slabs can be made here. Elsewhere each object gets a SectionMemoryManager instead.
+        static constexpr bool isSupported() {
+#ifdef __linux__
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        /// Take a block of each size, aligned as asked, all in the same slab.
+        /// A new slab is made when none has room, large enough for the blocks if they outgrow SlabSize.
+        Expected<std::array<Block, 3>> allocate(std::array<size_t, 3> Sizes, std::array<size_t, 3> Aligns) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            std::array<Block, 3> Blocks;
+            auto TakeAll = [&](Slab &S) {
+                for (unsigned P = 0; P < 3; ++P) {
+                    if (take(S, Part(P), Sizes[P], Aligns[P], Blocks[P])) continue;
+                    while (P--) give(Blocks[P]);
+                    return false;
+                }
+                return true;
+            };
+            for (auto &S : Slabs)
+                if (TakeAll(*S)) return Blocks;
+
+            size_t PartSize = SlabSize;
+            for (unsigned P = 0; P < 3; ++P) PartSize = std::max(PartSize, Sizes[P] + Aligns[P]);
+            auto S = createSlab(alignTo(PartSize, sys::Process::getPageSizeEstimate()));
+            if (!S) return S.takeError();
+            TakeAll(**S);
+            return Blocks;
+        }
+
+        /// Take one more block from S, for a section of an object whose other sections are in S.
+        /// It fails rather than take the block from another slab, which the object may not reach.
+        Expected<Block> allocateIn(Slab &S, Part P, size_t Size, size_t Align) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Block B;
+            if (!take(S, P, Size, Align, B))
+                return make_error<StringError>("no room left in the JIT slab of the object", inconvertibleErrorCode());
+            return B;
+        }
+
+        /// Give a block back, to be reused by objects loaded later.
+        void release(const Block &B) {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            give(B);
+        }
+
+        std::unique_ptr<RuntimeDyld::MemoryManager> createMemoryManager();
+    };
+
+    /// Loads one object into blocks of a SlabMemoryPool, reserved before its sections are allocated,
+    /// and gives them back when the object is removed.
+    class SlabMemoryManager : public RTDyldMemoryManager {
+        struct Section {
+            char *Write, *Exec;
+            size_t Size;
+        };
+
+        SlabMemoryPool &Pool;
+        std::vector<SlabMemoryPool::Block> Blocks;
+        std::array<SlabMemoryPool::Block, 3> Reserved;
+        std::array<size_t, 3> Used{};
+        std::vector<Section> Sections;
+        std::vector<Section> CodeSections;
+
+        uint8_t *allocate(SlabMemoryPool::Part P, uintptr_t Size, unsigned Alignment) {
+            Size = std::max<uintptr_t>(Size, 1);
+            Alignment = std::max(Alignment, 16u);
+            auto &R = Reserved[P];
+            auto Start = alignTo(Used[P], Alignment);
+            char *Write, *Exec;
+            if (R.S && Start + Size <= R.Size) {
+                Used[P] = Start + Size;
+                Write = R.write() + Start;
+                Exec = R.exec() + Start;
+            } else {
+                // Not in the reservation: the object has a section no one told us about.
+                // It still goes in the slab of the others, or the load fails.
+                if (!R.S) return nullptr;// nothing could be reserved, as reported then
+                auto New = Pool.allocateIn(*R.S, P, Size, Alignment);
+                if (!New) {
+                    logAllUnhandledErrors(New.takeError(), errs(), "JIT slab allocation failed: ");
+                    return nullptr;
+                }
+                Blocks.push_back(*New);
+                Write = New->write();
+                Exec = New->exec();
+            }
+            Sections.push_back({Write, Exec, Size});
+            if (P == SlabMemoryPool::Code) CodeSections.push_back(Sections.back());
+            return reinterpret_cast<uint8_t *>(Write);
+        }
+
+    public:
+        explicit SlabMemoryManager(SlabMemoryPool &Pool) : Pool(Pool) {}
+        ~SlabMemoryManager() override {
+            for (auto &B : Blocks) Pool.release(B);
+        }
+
+        bool needsToReserveAllocationSpace() override { return true; }
+
+        void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign, uintptr_t RODataSize,
+                                    uint32_t RODataAlign, uintptr_t RWDataSize, uint32_t RWDataAlign) override {
+            std::array<size_t, 3> Aligns{std::max(CodeAlign, 16u), std::max(RODataAlign, 16u), std::max(RWDataAlign, 16u)};
+            std::array<size_t, 3> Sizes{alignTo(CodeSize, Aligns[0]), alignTo(RODataSize, Aligns[1]),
+                                        alignTo(RWDataSize, Aligns[2])};
+            auto New = Pool.allocate(Sizes, Aligns);
+            if (!New) {
+                // Allocating the sections then fails, and so does the load.
+                logAllUnhandledErrors(New.takeError(), errs(), "JIT slab allocation failed: ");
+                return;
+            }
+            Reserved = *New;
+            for (auto &B : Reserved) Blocks.push_back(B);
+        }
+
+        uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned, StringRef) override {
+            return allocate(SlabMemoryPool::Code, Size, Alignment);
+        }
+
+        uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned, StringRef,
+                                     bool IsReadOnly) override {
+            return allocate(IsReadOnly ? SlabMemoryPool::ROData : SlabMemoryPool::RWData, Size, Alignment);
+        }
+
+        /// Sections are loaded where they are written, and must be relocated for where they run.
+        void notifyObjectLoaded(RuntimeDyld &RTDyld, const object::ObjectFile &) override {
+            for (auto &S : Sections) RTDyld.mapSectionAddress(S.Write, pointerToJITTargetAddress(S.Exec));
+        }
+
+        void registerEHFrames(uint8_t *, uint64_t LoadAddr, size_t Size) override {
+            RTDyldMemoryManager::registerEHFrames(jitTargetAddressToPointer<uint8_t *>(LoadAddr), LoadAddr, Size);
+        }
+
+        bool finalizeMemory(std::string *) override {
+            for (auto &S : CodeSections) sys::Memory::InvalidateInstructionCache(S.Exec, S.Size);
+            return false;
+        }
+    };
+
+    inline std::unique_ptr<RuntimeDyld::MemoryManager> SlabMemoryPool::createMemoryManager() {
+        return std::make_unique<SlabMemoryManager>(*this);
+    }
+}// namespace llvm::orc
+
+#endif// LLVM_EXECUTIONENGINE_ORC_SLABMEMORYMANAGER_H
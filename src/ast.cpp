@@ -1,86 +1,117 @@
-﻿#include "ast.h"
-#include "lexer.h"
+﻿#include "session.h"
 
-#include <iostream>
-#include <map>
+#include "llvm/ADT/SmallVector.h"
 
-int CURRENT_TOKEN;
-int get_next_token() { return CURRENT_TOKEN = get_token(); }
+#include <array>
+#include <ostream>
+#include <string>
 
-static std::unique_ptr<ExprAST> parse_number_expr();
-static std::unique_ptr<ExprAST> parse_paren_expr();
-static std::unique_ptr<ExprAST> parse_identifier_expr();
-static std::unique_ptr<ExprAST> parse_if_expr();
-static std::unique_ptr<ExprAST> parse_for_expr();
-static std::unique_ptr<ExprAST> parse_primary();
-static std::unique_ptr<ExprAST> parse_expression();
-static std::unique_ptr<ExprAST> parse_bin_op_rhs(int expr_prec, std::unique_ptr<ExprAST> lhs);
-static std::unique_ptr<PrototypeAST> parse_prototype();
+int CompilerSession::get_next_token() { return current_token = lexer->next(); }
 
 /// definition ::= 'def' prototype expression
-std::unique_ptr<FunctionAST> parse_definition() {
+std::unique_ptr<FunctionAST> CompilerSession::parse_definition() {
     get_next_token();// eat def.
     auto proto = parse_prototype();
     if (!proto) return nullptr;
+    proto->set_defined();
+    item_arena = ExprArena();
+    parsing_proto = proto.get();
     auto e = parse_expression();
-    return e ? std::make_unique<FunctionAST>(std::move(proto), std::move(e)) : nullptr;
+    parsing_proto = nullptr;
+    if (!e) return nullptr;
+    return std::make_unique<FunctionAST>(std::move(proto), std::move(item_arena), e);
 }
 
 /// external ::= 'extern' prototype
-std::unique_ptr<PrototypeAST> parse_extern() {
+std::unique_ptr<PrototypeAST> CompilerSession::parse_extern() {
     get_next_token();// eat extern.
-    return parse_prototype();
+    auto proto = parse_prototype();
+    if (!proto) return nullptr;
+    describe_extern(*proto);
+    return proto;
 }
 
 /// toplevelexpr ::= expression
-std::unique_ptr<FunctionAST> parse_top_level_expr() {
+std::unique_ptr<FunctionAST> CompilerSession::parse_top_level_expr() {
+    item_arena = ExprArena();
     auto e = parse_expression();
-    // Make an anonymous proto.
-    return e ? std::make_unique<FunctionAST>(
-                   std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>()),
-                   std::move(e))
-             : nullptr;
+    if (!e) return nullptr;
+    // Make an anonymous proto, named uniquely so it never clashes with an earlier one.
+    auto name = "__anon_expr." + std::to_string(anon_count++);
+    return std::make_unique<FunctionAST>(
+        std::make_unique<PrototypeAST>(symbols.intern(name), std::vector<Symbol>()),
+        std::move(item_arena),
+        e,
+        true);
 }
 
 /// log_error* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> log_error(const char *str) {
-    std::cerr << "error: " << str << std::endl;
-    return nullptr;
+ExprId CompilerSession::log_error(const char *str) {
+    ++error_count;
+    diagnostics << "error: " << str << std::endl;
+    return NO_EXPR;
 }
-static std::unique_ptr<PrototypeAST> log_error_p(const char *str) {
+std::unique_ptr<PrototypeAST> CompilerSession::log_error_p(const char *str) {
     log_error(str);
     return nullptr;
 }
 
+/// BUILTIN_PRECEDENCE - The precedence of each builtin binary operator, -1 for any other char.
+constexpr static auto BUILTIN_PRECEDENCE = [] {
+    std::array<int8_t, 256> ans{};
+    ans.fill(-1);
+    ans['<'] = 10;
+    ans['+'] = 20;
+    ans['-'] = 20;
+    ans['*'] = 30;
+    return ans;
+}();
+std::array<int8_t, 256> CompilerSession::builtin_precedence() { return BUILTIN_PRECEDENCE; }
+
 /// get_token_precedence - Get the precedence of the pending binary operator token.
-static int get_token_precedence() {
-    if (!isascii(CURRENT_TOKEN)) return -1;
-    /// BINOP_PRECEDENCE - This holds the precedence for each binary operator that is defined.
-    const static auto binop_precedence = std::map<char, int>{
-        {'<', 10},
-        {'+', 20},
-        {'-', 20},
-        {'*', 30},
-    };
-    // Make sure it's a declared binop.
-    auto ans = binop_precedence.find(CURRENT_TOKEN);
-    return ans != binop_precedence.end() ? ans->second : -1;
+int CompilerSession::get_token_precedence() const {
+    return isascii(current_token) ? binop_precedence[current_token] : -1;
+}
+
+/// install_operator - Make a user defined operator known to the parser, once it is compiled,
+/// so a definition with an error leaves later input parsing as it did.
+void CompilerSession::install_operator(const PrototypeAST &proto) {
+    if (proto.is_binary_op())
+        binop_precedence[proto.get_operator()] = proto.get_binary_precedence();
+    else if (proto.is_unary_op())
+        unary_ops[proto.get_operator()] = true;
+}
+
+Symbol CompilerSession::operator_symbol(bool binary, char op) {
+    std::string_view prefix = binary ? "binary" : "unary";
+    char name[8];
+    prefix.copy(name, prefix.size());
+    name[prefix.size()] = op;
+    return symbols.intern({name, prefix.size() + 1});
+}
+
+bool CompilerSession::is_buffer(Symbol name) const {
+    if (!parsing_proto) return false;
+    const auto &args = parsing_proto->get_args();
+    for (size_t i = 0; i < args.size(); ++i)
+        if (args[i] == name) return parsing_proto->is_buffer(i);
+    return false;
 }
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> parse_number_expr() {
-    auto ans = std::make_unique<NumberExprAST>(NUM_VAL);
+ExprId CompilerSession::parse_number_expr() {
+    auto ans = item_arena.number(lexer->number());
     get_next_token();// consume the number
     return ans;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> parse_paren_expr() {
+ExprId CompilerSession::parse_paren_expr() {
     get_next_token();// eat (.
     auto v = parse_expression();
-    if (!v) return nullptr;
+    if (!v) return NO_EXPR;
 
-    if (CURRENT_TOKEN != ')') return log_error("expected ')'");
+    if (current_token != ')') return log_error("expected ')'");
     get_next_token();// eat ).
     return v;
 }
@@ -88,20 +119,45 @@ static std::unique_ptr<ExprAST> parse_paren_expr() {
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> parse_identifier_expr() {
-    auto id_name = std::move(IDENTIFIER_STR);
+///   ::= identifier '[' expression ']' ('=' expression)?
+///   ::= 'len' '(' identifier ')'
+ExprId CompilerSession::parse_identifier_expr() {
+    auto id_name = symbols.intern(lexer->identifier());
     get_next_token();// eat identifier.
 
+    // Element of a buffer.
+    if (current_token == '[') {
+        if (!is_buffer(id_name)) return log_error("Only a buffer parameter can be indexed");
+        get_next_token();// eat [
+        auto index = parse_expression();
+        if (!index) return NO_EXPR;
+        if (current_token != ']') return log_error("Expected ']'");
+        get_next_token();// eat ]
+        if (current_token != '=') return item_arena.index(id_name, index);
+        get_next_token();// eat =
+        auto value = parse_expression();
+        if (!value) return NO_EXPR;
+        return item_arena.store(id_name, index, value);
+    }
     // Simple variable ref.
-    if (CURRENT_TOKEN != '(') return std::make_unique<VariableExprAST>(id_name);
-    // Call.
+    if (current_token != '(') return item_arena.variable(id_name);
     get_next_token();// eat (
-    std::vector<std::unique_ptr<ExprAST>> args;
-    while (CURRENT_TOKEN != ')') {
+    // Length of a buffer.
+    if (symbols.name(id_name) == "len" && current_token == tok_identifier) {
+        auto buffer = symbols.intern(lexer->identifier());
+        if (is_buffer(buffer)) {
+            if (get_next_token() != ')') return log_error("Expected ')' after len(buffer");
+            get_next_token();// eat )
+            return item_arena.length(buffer);
+        }
+    }
+    // Call.
+    llvm::SmallVector<ExprId, 8> args;
+    while (current_token != ')') {
         auto a = parse_expression();
-        if (!a) return nullptr;
-        args.emplace_back(std::move(a));
-        switch (CURRENT_TOKEN) {
+        if (!a) return NO_EXPR;
+        args.push_back(a);
+        switch (current_token) {
             case ',':
                 get_next_token();
             case ')':
@@ -112,15 +168,15 @@ static std::unique_ptr<ExprAST> parse_identifier_expr() {
     }
     // Eat the ')'.
     get_next_token();
-    return std::make_unique<CallExprAST>(std::move(id_name), std::move(args));
+    return item_arena.call(id_name, args);
 }
 
 /// primary
 ///   ::= identifierexpr
 ///   ::= numberexpr
 ///   ::= parenexpr
-static std::unique_ptr<ExprAST> parse_primary() {
-    switch (CURRENT_TOKEN) {
+ExprId CompilerSession::parse_primary() {
+    switch (current_token) {
         case tok_identifier:
             return parse_identifier_expr();
         case tok_number:
@@ -130,134 +186,202 @@ static std::unique_ptr<ExprAST> parse_primary() {
         case tok_if:
             return parse_if_expr();
         case tok_for:
+        case tok_pfor:
             return parse_for_expr();
         default:
             return log_error("unknown token when expecting an expression");
     }
 }
 
-/// expression ::= primary binoprhs
-static std::unique_ptr<ExprAST> parse_expression() {
-    auto lhs = parse_primary();
-    return lhs ? parse_bin_op_rhs(0, std::move(lhs)) : nullptr;
+/// unary
+///   ::= primary
+///   ::= unaryop unary
+ExprId CompilerSession::parse_unary() {
+    // Collect the prefix operators first, so a long run of them does not recurse.
+    llvm::SmallVector<char, 4> ops;
+    for (; isascii(current_token) && unary_ops[current_token]; get_next_token()) ops.push_back(current_token);
+
+    auto operand = parse_primary();
+    if (!operand) return NO_EXPR;
+    while (!ops.empty()) operand = item_arena.unary(ops.pop_back_val(), operand);
+    return operand;
 }
 
-/// binoprhs ::= ('+' primary)*
-static std::unique_ptr<ExprAST> parse_bin_op_rhs(int expr_prec, std::unique_ptr<ExprAST> lhs) {
-    // If this is a binop, find its precedence.
+/// expression ::= unary (binop unary)*
+/// Operators waiting for their right operand are kept on a stack,
+/// so parsing a long chain of operators takes no recursion at all.
+ExprId CompilerSession::parse_expression() {
+    struct Pending {
+        char op;
+        int prec;
+        ExprId lhs;
+    };
+    llvm::SmallVector<Pending, 8> pending;
+
+    auto lhs = parse_unary();
+    if (!lhs) return NO_EXPR;
     while (true) {
+        // If this is a binop, find its precedence. -1 if it is not.
         auto tok_prec = get_token_precedence();
 
-        // If this is a binop that binds at least as tightly as the current binop,
-        // consume it, otherwise we are done.
-        if (tok_prec < expr_prec) return lhs;
+        // Every pending binop that binds at least as tightly as this one takes lhs as its rhs.
+        while (!pending.empty() && pending.back().prec >= tok_prec) {
+            auto p = pending.pop_back_val();
+            lhs = item_arena.binary(p.op, p.lhs, lhs);
+        }
+        if (tok_prec < 0) return lhs;
 
         // Okay, we know this is a binop.
-        auto bin_op = CURRENT_TOKEN;
+        pending.push_back({static_cast<char>(current_token), tok_prec, lhs});
         get_next_token();// eat binop
 
-        // Parse the primary expression after the binary operator.
-        auto rhs = parse_primary();
-        if (!rhs) return nullptr;
-
-        // If BinOp binds less tightly with RHS than the operator after RHS,
-        // let the pending operator take RHS as its LHS.
-        auto next_prec = get_token_precedence();
-        if (tok_prec < next_prec) {
-            if (!(rhs = parse_bin_op_rhs(tok_prec + 1, std::move(rhs)))) return nullptr;
-        }
-
-        // Merge LHS/RHS.
-        lhs = std::make_unique<BinaryExprAST>(bin_op, std::move(lhs), std::move(rhs));
-    }// loop around to the top of the while loop.
+        // Parse the unary expression after the binary operator.
+        if (!(lhs = parse_unary())) return NO_EXPR;
+    }
 }
 
-/// prototype ::= id '(' id* ')'
-static std::unique_ptr<PrototypeAST> parse_prototype() {
-    if (CURRENT_TOKEN != tok_identifier) return log_error_p("Expected function name in prototype");
-
-    auto fn_name = std::move(IDENTIFIER_STR);
-    get_next_token();
-
-    if (CURRENT_TOKEN != '(') return log_error_p("Expected '(' in prototype");
+/// prototype
+///   ::= id '(' param* ')'
+///   param ::= id | id '[' ']'
+///   ::= binary LETTER number? (id, id)
+///   ::= unary LETTER (id)
+std::unique_ptr<PrototypeAST> CompilerSession::parse_prototype() {
+    Symbol fn_name;
+    char op = 0;
+    unsigned kind = 0;// 0 = identifier, 1 = unary, 2 = binary.
+    unsigned binary_precedence = 30;
+
+    switch (current_token) {
+        case tok_identifier:
+            fn_name = symbols.intern(lexer->identifier());
+            get_next_token();
+            break;
+        case tok_unary:
+        case tok_binary:
+            kind = current_token == tok_unary ? 1 : 2;
+            get_next_token();
+            if (!isascii(current_token) || isalnum(current_token) || current_token == '(' || current_token == ',')
+                return log_error_p("Expected operator");
+            op = static_cast<char>(current_token);
+            fn_name = operator_symbol(kind == 2, op);
+            get_next_token();
+            // Read the precedence if present.
+            if (kind == 2 && current_token == tok_number) {
+                auto num = lexer->number();
+                if (num < 1 || num > 100) return log_error_p("Invalid precedence: must be 1..100");
+                binary_precedence = static_cast<unsigned>(num);
+                get_next_token();
+            }
+            break;
+        default:
+            return log_error_p("Expected function name in prototype");
+    }
 
-    std::vector<std::string> arg_names;
-    while (get_next_token() == tok_identifier) arg_names.emplace_back(std::move(IDENTIFIER_STR));
-    if (CURRENT_TOKEN != ')') return log_error_p("Expected ')' in prototype");
+    if (current_token != '(') return log_error_p("Expected '(' in prototype");
+
+    std::vector<Symbol> arg_names;
+    std::vector<bool> buffers;
+    get_next_token();// eat '('.
+    while (current_token == tok_identifier) {
+        arg_names.push_back(symbols.intern(lexer->identifier()));
+        if (get_next_token() != '[') continue;
+        if (get_next_token() != ']') return log_error_p("Expected ']' after '[' in prototype");
+        buffers.resize(arg_names.size());
+        buffers.back() = true;
+        get_next_token();// eat ']'.
+    }
+    if (current_token != ')') return log_error_p("Expected ')' in prototype");
 
     // success.
     get_next_token();// eat ')'.
 
-    return std::make_unique<PrototypeAST>(std::move(fn_name), std::move(arg_names));
+    // Verify right number of names for operator.
+    if (kind && arg_names.size() != kind) return log_error_p("Invalid number of operands for operator");
+    if (kind && !buffers.empty()) return log_error_p("Operands of an operator can not be buffers");
+    if (!buffers.empty()) buffers.resize(arg_names.size());
+
+    return std::make_unique<PrototypeAST>(fn_name, std::move(arg_names), op, binary_precedence, std::move(buffers));
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> parse_if_expr() {
+ExprId CompilerSession::parse_if_expr() {
     get_next_token();// eat the if.
 
     // condition.
     auto cond = parse_expression();
-    if (!cond) return nullptr;
+    if (!cond) return NO_EXPR;
 
-    if (CURRENT_TOKEN != tok_then)
+    if (current_token != tok_then)
         return log_error("expected then");
     get_next_token();// eat the then
 
     auto then = parse_expression();
-    if (!then) return nullptr;
+    if (!then) return NO_EXPR;
 
-    if (CURRENT_TOKEN != tok_else)
+    if (current_token != tok_else)
         return log_error("expected else");
 
     get_next_token();
 
     auto else_ = parse_expression();
-    if (!else_) return nullptr;
+    if (!else_) return NO_EXPR;
 
-    return std::make_unique<IfExprAST>(
-        std::move(cond),
-        std::move(then),
-        std::move(else_));
+    return item_arena.if_(cond, then, else_);
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> parse_for_expr() {
+/// forexpr
+///   ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+///   ::= 'pfor' ('sum' | 'min' | 'max')? identifier '=' expr ',' expr (',' expr)? 'in' expression
+ExprId CompilerSession::parse_for_expr() {
+    auto parallel = current_token == tok_pfor;
     get_next_token();// eat the for.
 
-    if (CURRENT_TOKEN != tok_identifier) return log_error("expected identifier after for");
+    if (current_token != tok_identifier) return log_error("expected identifier after for");
 
-    auto id_name = std::move(IDENTIFIER_STR);
+    auto id_name = symbols.intern(lexer->identifier());
     get_next_token();// eat identifier.
 
-    if (CURRENT_TOKEN != '=') return log_error("expected '=' after for");
+    // A second identifier makes the first one the reduction.
+    auto reduction = reduce_none;
+    if (parallel && current_token == tok_identifier) {
+        auto name = symbols.name(id_name);
+        if (name == "sum")
+            reduction = reduce_sum;
+        else if (name == "min")
+            reduction = reduce_min;
+        else if (name == "max")
+            reduction = reduce_max;
+        else
+            return log_error("expected sum, min or max as the reduction of pfor");
+        id_name = symbols.intern(lexer->identifier());
+        get_next_token();// eat identifier.
+    }
+
+    if (current_token != '=') return log_error("expected '=' after for");
     get_next_token();// eat '='.
 
     auto start = parse_expression();
-    if (!start) return nullptr;
-    if (CURRENT_TOKEN != ',') return log_error("expected ',' after for start value");
+    if (!start) return NO_EXPR;
+    if (current_token != ',') return log_error("expected ',' after for start value");
     get_next_token();
 
     auto end = parse_expression();
-    if (!end) return nullptr;
+    if (!end) return NO_EXPR;
 
     // The step value is optional.
-    std::unique_ptr<ExprAST> step;
-    if (CURRENT_TOKEN == ',') {
+    ExprId step = NO_EXPR;
+    if (current_token == ',') {
         get_next_token();
         step = parse_expression();
-        if (!step) return nullptr;
+        if (!step) return NO_EXPR;
     }
 
-    if (CURRENT_TOKEN != tok_in) return log_error("expected 'in' after for");
+    if (current_token != tok_in) return log_error("expected 'in' after for");
     get_next_token();// eat 'in'.
 
     auto body = parse_expression();
-    if (!body) return nullptr;
-
-    return std::make_unique<ForExprAST>(
-        id_name,
-        std::move(start),
-        std::move(end),
-        std::move(step),
-        std::move(body));
+    if (!body) return NO_EXPR;
+
+    if (parallel) return item_arena.pfor(reduction, id_name, start, end, step, body);
+    return item_arena.for_(id_name, start, end, step, body);
 }
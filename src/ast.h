@@ -1,145 +1,223 @@
 ﻿#ifndef __AST_H__
 #define __AST_H__
 
-#include "KaleidoscopeJIT.h"
+#include "runtime.h"
+#include "symbol.h"
 
-#include "llvm/IR/Function.h"
+#include "llvm/ADT/ArrayRef.h"
 
+#include <cstdint>
 #include <memory>
-#include <string>
 #include <vector>
 
-/// ExprAST - Base class for all expression nodes.
-class ExprAST {
-public:
-    virtual ~ExprAST() {}
-    virtual llvm::Value *codegen() = 0;
+/// ExprId - Index of an expression node in the arena of its top-level item.
+/// Id 0 is never a node, it stands for "no expression" (a parse error or an omitted part).
+using ExprId = uint32_t;
+constexpr ExprId NO_EXPR = 0;
+
+/// ExprKind - Tells which payload of an ExprAST is in use.
+enum ExprKind : uint8_t {
+    expr_number,
+    expr_variable,
+    expr_unary,
+    expr_binary,
+    expr_call,
+    expr_if,
+    expr_for,
+    expr_pfor,  // pfor sum i = ... in ...
+    expr_index, // a[i]
+    expr_store, // a[i] = v
+    expr_length,// len(a)
 };
 
-/// NumberExprAST - Expression class for numeric literals like "1.0".
-class NumberExprAST : public ExprAST {
-    double val;
-
-public:
-    explicit NumberExprAST(double val)
-        : val(val) {}
-    llvm::Value *codegen() override;
+/// UnaryExprAST - Expression for a unary operator.
+struct UnaryExprAST {
+    char opcode;
+    ExprId operand;
 };
 
-/// VariableExprAST - Expression class for referencing a variable, like "a".
-class VariableExprAST : public ExprAST {
-    std::string name;
+/// BinaryExprAST - Expression for a binary operator.
+struct BinaryExprAST {
+    char op;
+    ExprId lhs, rhs;
+};
 
-public:
-    explicit VariableExprAST(std::string name)
-        : name(std::move(name)) {}
-    llvm::Value *codegen() override;
+/// CallExprAST - Expression for function calls.
+/// The arguments are arg_count consecutive ids in the arena, starting at first_arg.
+struct CallExprAST {
+    Symbol callee;
+    uint32_t first_arg, arg_count;
 };
 
-/// BinaryExprAST - Expression class for a binary operator.
-class BinaryExprAST : public ExprAST {
-    char op;
-    std::unique_ptr<ExprAST> lhs, rhs;
+/// IfExprAST - Expression for if/then/else.
+struct IfExprAST {
+    ExprId cond, then, else_;
+};
 
-public:
-    BinaryExprAST(char op,
-                  std::unique_ptr<ExprAST> lhs,
-                  std::unique_ptr<ExprAST> rhs)
-        : op(op),
-          lhs(std::move(lhs)),
-          rhs(std::move(rhs)) {}
-    llvm::Value *codegen() override;
+/// ForExprAST - Expression for for/in, and pfor/in. step is NO_EXPR if it is omitted.
+/// The iterations of a pfor may run in any order, on any thread, and reduction combines their values.
+struct ForExprAST {
+    Symbol var_name;
+    ExprId start, end, step, body;
+    uint8_t reduction;// a Reduction, reduce_none for a for
 };
 
-/// CallExprAST - Expression class for function calls.
-class CallExprAST : public ExprAST {
-    std::string callee;
-    std::vector<std::unique_ptr<ExprAST>> args;
+/// IndexExprAST - Expression for an element of a buffer, read, or written if value is not NO_EXPR.
+struct IndexExprAST {
+    Symbol buffer;
+    ExprId index, value;
+};
 
-public:
-    CallExprAST(std::string callee,
-                std::vector<std::unique_ptr<ExprAST>> args)
-        : callee(std::move(callee)),
-          args(std::move(args)) {}
-    llvm::Value *codegen() override;
+/// ExprAST - An expression node, a tagged union of every kind of expression.
+/// Numeric literals like "1.0" keep their value in number,
+/// references to a variable like "a", or to the length of a buffer like "len(a)", keep its name in variable.
+struct ExprAST {
+    ExprKind kind;
+    union {
+        double number;
+        Symbol variable;
+        UnaryExprAST unary;
+        BinaryExprAST binary;
+        CallExprAST call;
+        IfExprAST if_;
+        ForExprAST for_;
+        IndexExprAST index;
+    };
 };
 
-/// IfExprAST - Expression class for if/then/else.
-class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> cond, then, else_;
+/// ExprArena - Stores every expression node of one top-level item contiguously.
+/// Children are referenced by id, and the whole tree is released at once with the arena.
+class ExprArena {
+    std::vector<ExprAST> nodes;
+    std::vector<ExprId> call_args;
+
+    ExprId push(ExprAST node) {
+        nodes.push_back(node);
+        return static_cast<ExprId>(nodes.size() - 1);
+    }
 
 public:
-    IfExprAST(std::unique_ptr<ExprAST> cond,
-              std::unique_ptr<ExprAST> then,
-              std::unique_ptr<ExprAST> else_)
-        : cond(std::move(cond)),
-          then(std::move(then)),
-          else_(std::move(else_)) {}
-    llvm::Value *codegen() override;
+    ExprArena() : nodes(1) {}
+
+    inline const ExprAST &operator[](ExprId id) const { return nodes[id]; }
+    /// size - Number of nodes in the arena.
+    inline size_t size() const { return nodes.size() - 1; }
+    inline llvm::ArrayRef<ExprId> args(const CallExprAST &call) const {
+        return llvm::ArrayRef<ExprId>(call_args).slice(call.first_arg, call.arg_count);
+    }
+
+    ExprId number(double val) {
+        return push({.kind = expr_number, .number = val});
+    }
+    ExprId variable(Symbol name) {
+        return push({.kind = expr_variable, .variable = name});
+    }
+    ExprId unary(char opcode, ExprId operand) {
+        return push({.kind = expr_unary, .unary = {opcode, operand}});
+    }
+    ExprId binary(char op, ExprId lhs, ExprId rhs) {
+        return push({.kind = expr_binary, .binary = {op, lhs, rhs}});
+    }
+    ExprId call(Symbol callee, llvm::ArrayRef<ExprId> args) {
+        ExprAST node{.kind = expr_call,
+                     .call = {callee, static_cast<uint32_t>(call_args.size()), static_cast<uint32_t>(args.size())}};
+        call_args.insert(call_args.end(), args.begin(), args.end());
+        return push(node);
+    }
+    ExprId if_(ExprId cond, ExprId then, ExprId else_) {
+        return push({.kind = expr_if, .if_ = {cond, then, else_}});
+    }
+    ExprId for_(Symbol var_name, ExprId start, ExprId end, ExprId step, ExprId body) {
+        return push({.kind = expr_for, .for_ = {var_name, start, end, step, body, reduce_none}});
+    }
+    ExprId pfor(Reduction reduction, Symbol var_name, ExprId start, ExprId end, ExprId step, ExprId body) {
+        return push({.kind = expr_pfor,
+                     .for_ = {var_name, start, end, step, body, static_cast<uint8_t>(reduction)}});
+    }
+    ExprId index(Symbol buffer, ExprId index) {
+        return push({.kind = expr_index, .index = {buffer, index, NO_EXPR}});
+    }
+    ExprId store(Symbol buffer, ExprId index, ExprId value) {
+        return push({.kind = expr_store, .index = {buffer, index, value}});
+    }
+    ExprId length(Symbol buffer) {
+        return push({.kind = expr_length, .variable = buffer});
+    }
 };
 
-/// ForExprAST - Expression class for for/in.
-class ForExprAST : public ExprAST {
-    std::string var_name;
-    std::unique_ptr<ExprAST> start, end, step, body;
-
-public:
-    ForExprAST(const std::string &var_name,
-               std::unique_ptr<ExprAST> start,
-               std::unique_ptr<ExprAST> end,
-               std::unique_ptr<ExprAST> step,
-               std::unique_ptr<ExprAST> body)
-        : var_name(var_name),
-          start(std::move(start)),
-          end(std::move(end)),
-          step(std::move(step)),
-          body(std::move(body)) {}
-    llvm::Value *codegen() override;
+/// Effects - What a call to a function may do, as far as the compiler can tell.
+struct Effects {
+    bool pure = false;      // reads and writes no memory
+    bool nounwind = false;  // never unwinds
+    bool terminates = false;// always returns
+    bool readonly = false;  // writes no memory
+    bool argmem = false;    // touches no memory but the buffers passed to it
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
 /// which captures its name, and its argument names
-/// (thus implicitly the number of arguments the function takes).
+/// (thus implicitly the number of arguments the function takes),
+/// as well as if it is an operator.
+/// A parameter declared like `a[]` is a buffer: a pointer to doubles and their count, owned by the caller.
 class PrototypeAST {
-    std::string name;
-    std::vector<std::string> args;
+    Symbol name;
+    std::vector<Symbol> args;
+    std::vector<bool> buffers;// which of args are buffers, empty if none is
+    char op;
+    unsigned precedence;// Precedence if a binary op.
+    Effects effects;    // none assumed, until inferred from a body or known for an extern
+    unsigned intrinsic = 0;// LLVM intrinsic a known extern is lowered to, 0 if none
+    bool defined = false;  // a definition's prototype, rather than an extern's or a top-level expression's
 
 public:
-    PrototypeAST(std::string name, std::vector<std::string> args)
-        : name(std::move(name)), args(std::move(args)) {}
-    llvm::Function *codegen();
-
-    inline const auto &get_name() const { return name; }
+    PrototypeAST(Symbol name, std::vector<Symbol> args, char op = 0, unsigned precedence = 0,
+                 std::vector<bool> buffers = {})
+        : name(name), args(std::move(args)), buffers(std::move(buffers)), op(op), precedence(precedence) {}
+
+    inline Symbol get_name() const { return name; }
+    inline const auto &get_args() const { return args; }
+    inline bool is_buffer(size_t i) const { return i < buffers.size() && buffers[i]; }
+    inline bool has_buffers() const { return !buffers.empty(); }
+
+    inline bool is_unary_op() const { return op && args.size() == 1; }
+    inline bool is_binary_op() const { return op && args.size() == 2; }
+    inline char get_operator() const { return op; }
+    inline unsigned get_binary_precedence() const { return precedence; }
+    inline const Effects &get_effects() const { return effects; }
+    inline void set_effects(const Effects &e) { effects = e; }
+    inline unsigned get_intrinsic() const { return intrinsic; }
+    inline void set_intrinsic(unsigned id) { intrinsic = id; }
+    inline bool is_defined() const { return defined; }
+    inline void set_defined() { defined = true; }
 };
 
 /// FunctionAST - This class represents a function definition itself.
+/// It owns the arena its body lives in.
 class FunctionAST {
     std::unique_ptr<PrototypeAST> proto;
-    std::unique_ptr<ExprAST> body;
+    ExprArena arena;
+    ExprId body;
+    bool top_level;// an anonymous function wrapping a top-level expression
 
 public:
     FunctionAST(std::unique_ptr<PrototypeAST> proto,
-                std::unique_ptr<ExprAST> body)
+                ExprArena arena,
+                ExprId body,
+                bool top_level = false)
         : proto(std::move(proto)),
-          body(std::move(body)) {}
-    llvm::Function *codegen();
+          arena(std::move(arena)),
+          body(body),
+          top_level(top_level) {}
+
+    inline const PrototypeAST &get_proto() const { return *proto; }
+    /// take_proto - Move the prototype out. get_proto must not be called after it, though a reference
+    /// it returned before stays valid for as long as the prototype lives.
+    inline std::unique_ptr<PrototypeAST> take_proto() { return std::move(proto); }
+    inline const ExprArena &get_arena() const { return arena; }
+    /// take_arena - Move the nodes of the body out, once it has been emitted.
+    inline ExprArena take_arena() { return std::move(arena); }
+    inline ExprId get_body() const { return body; }
+    inline bool is_top_level() const { return top_level; }
 };
 
-/// CURRENT_TOKEN/getNextToken - Provide a simple token buffer.
-/// CURRENT_TOKEN is the current token the parser is looking at.
-/// get_next_token reads another token from the lexer and updates CurTok with its results.
-extern int CURRENT_TOKEN;
-int get_next_token();
-
-std::unique_ptr<ExprAST> log_error(const char *);
-std::unique_ptr<FunctionAST> parse_definition();
-std::unique_ptr<FunctionAST> parse_top_level_expr();
-std::unique_ptr<PrototypeAST> parse_extern();
-
-extern llvm::ExitOnError EXIT_ON_ERROR;
-extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> THE_JIT;
-void initialize_module_and_pass_manager();
-void update_module_and_pass_manager();
-void update_function_proto(std::unique_ptr<PrototypeAST> &&proto_ast);
-
 #endif// __AST_H__
@@ -1,281 +1,1008 @@
-﻿#include "ast.h"
+﻿#include "session.h"
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
 
-#include <map>
+#include <cassert>
+#include <cmath>
+#include <limits>
 
-static std::unique_ptr<llvm::LLVMContext> THE_CONTEXT;
-static std::unique_ptr<llvm::Module> THE_MODULE;
-static std::unique_ptr<llvm::IRBuilder<>> BUILDER;
-static std::map<std::string, llvm::Value *> NAMED_VALUES;
-static std::unique_ptr<llvm::legacy::FunctionPassManager> THE_FPM;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FUNCTION_PROTOS;
-
-static llvm::Value *log_error_v(const char *str) {
+llvm::Value *CompilerSession::log_error_v(const char *str) {
     log_error(str);
     return nullptr;
 }
-static llvm::Function *get_function(const std::string &name) {
+std::string CompilerSession::body_name(const PrototypeAST &proto) {
+    auto name = symbols.name(proto.get_name()).str();
+    return proto.is_defined() ? name + ".fast" : name;
+}
+llvm::FunctionType *CompilerSession::function_type(const PrototypeAST &proto) {
+    const auto ty_double = llvm::Type::getDoubleTy(*context);
+    std::vector<llvm::Type *> params;
+    for (size_t i = 0; i < proto.get_args().size(); ++i) {
+        if (!proto.is_buffer(i)) {
+            params.push_back(ty_double);
+            continue;
+        }
+        params.push_back(llvm::PointerType::getUnqual(ty_double));
+        params.push_back(llvm::Type::getInt64Ty(*context));
+    }
+    return llvm::FunctionType::get(ty_double, params, false);
+}
+
+llvm::Function *CompilerSession::get_function(Symbol name) {
+    // If no existing prototype exists, the function can only be one added to the current module.
+    auto fi = function_protos.find(name);
+    if (fi == function_protos.end()) return module->getFunction(symbols.name(name));
+
     // First, see if the function has already been added to the current module.
-    if (auto *f = THE_MODULE->getFunction(name)) return f;
+    if (auto *f = module->getFunction(body_name(*fi->second))) return f;
 
-    // If not, check whether we can codegen the declaration from some existing prototype.
-    auto fi = FUNCTION_PROTOS.find(name);
-    if (fi != FUNCTION_PROTOS.end()) return fi->second->codegen();
+    // If not, codegen the declaration from the prototype.
+    auto f = codegen(*fi->second);
 
-    // If no existing prototype exists, return null.
-    return nullptr;
+    // A small function from an earlier module comes with its body, for the optimizer to inline.
+    auto bi = function_bodies.find(name);
+    if (bi != function_bodies.end()) import_body(f, *fi->second, bi->second);
+    return f;
 }
 
-llvm::ExitOnError EXIT_ON_ERROR;
-std::unique_ptr<llvm::orc::KaleidoscopeJIT> THE_JIT;
-void initialize_module_and_pass_manager() {
-    // Open a new context and module.
-    THE_CONTEXT = std::make_unique<llvm::LLVMContext>();
-    THE_MODULE = std::make_unique<llvm::Module>("my cool jit", *THE_CONTEXT);
-    THE_MODULE->setDataLayout(THE_JIT->getDataLayout());
-
-    // Create a new builder for the module.
-    BUILDER = std::make_unique<llvm::IRBuilder<>>(*THE_CONTEXT);
+llvm::Function *CompilerSession::get_intrinsic(Symbol name) {
+    auto fi = function_protos.find(name);
+    if (fi == function_protos.end() || !fi->second->get_intrinsic()) return nullptr;
+    return llvm::Intrinsic::getDeclaration(module.get(), fi->second->get_intrinsic(), {llvm::Type::getDoubleTy(*context)});
+}
 
-    // Create a new pass manager attached to it.
-    THE_FPM = std::make_unique<llvm::legacy::FunctionPassManager>(THE_MODULE.get());
+void CompilerSession::import_body(llvm::Function *f, const PrototypeAST &proto, const Body &body) {
+    // Called while another body is being emitted, so leave the builder as it was.
+    llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+    auto caller_values = std::move(named_values);
+    auto caller_buffers = std::move(buffers);
+    if (emit_body(f, proto, body.arena, body.body)) {
+        // The copy is only there to be inlined: the function is still compiled once, in its own module.
+        f->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+    }
+    named_values = std::move(caller_values);
+    buffers = std::move(caller_buffers);
+}
 
-    // Do simple "peephole" optimizations and bit-twiddling optzns.
-    THE_FPM->add(llvm::createInstructionCombiningPass());
-    // Reassociate expressions.
-    THE_FPM->add(llvm::createReassociatePass());
-    // Eliminate Common SubExpressions.
-    THE_FPM->add(llvm::createGVNPass());
-    // Simplify the control flow graph (deleting unreachable blocks, etc).
-    THE_FPM->add(llvm::createCFGSimplificationPass());
+void CompilerSession::initialize_module() {
+    // Open a new context and module.
+    context = std::make_unique<llvm::LLVMContext>();
+    module = std::make_unique<llvm::Module>("my cool jit", *context);
+    module->setDataLayout(data_layout);
 
-    THE_FPM->doInitialization();
+    // Create a new builder for the module.
+    builder = std::make_unique<llvm::IRBuilder<>>(*context);
+    set_fast_math(fast_math);
+}
+void CompilerSession::set_fast_math(bool on) {
+    fast_math = on;
+    llvm::FastMathFlags fmf;
+    fmf.setAllowReassoc(on);
+    fmf.setAllowContract(on);
+    builder->setFastMathFlags(fmf);
 }
-void update_module_and_pass_manager() {
-    EXIT_ON_ERROR(THE_JIT->addModule(llvm::orc::ThreadSafeModule(std::move(THE_MODULE), std::move(THE_CONTEXT))));
-    initialize_module_and_pass_manager();
+llvm::orc::ThreadSafeModule CompilerSession::take_module() {
+    llvm::orc::ThreadSafeModule tsm(std::move(module), std::move(context));
+    initialize_module();
+    return tsm;
 }
-void update_function_proto(std::unique_ptr<PrototypeAST> &&proto_ast) {
-    FUNCTION_PROTOS[proto_ast->get_name()] = std::move(proto_ast);
+llvm::Error CompilerSession::update_module(llvm::orc::ResourceTrackerSP rt) {
+    if (!rt) rt = dylib->getDefaultResourceTracker();
+    return jit->addModule(take_module(), std::move(rt));
+}
+void CompilerSession::update_function_proto(std::unique_ptr<PrototypeAST> &&proto_ast) {
+    // A definition's operator is installed once its body is emitted.
+    if (!proto_ast->is_defined()) install_operator(*proto_ast);
+    function_protos[proto_ast->get_name()] = std::move(proto_ast);
 }
 
-llvm::Value *NumberExprAST::codegen() {
-    return llvm::ConstantFP::get(*THE_CONTEXT, llvm::APFloat(val));
+llvm::Value *CompilerSession::codegen_number(double val) {
+    return llvm::ConstantFP::get(*context, llvm::APFloat(val));
 }
 
-llvm::Value *VariableExprAST::codegen() {
+llvm::Value *CompilerSession::codegen_variable(Symbol name) {
     // Look this variable up in the function.
-    const auto v = NAMED_VALUES[name];
+    const auto v = named_values.lookup(name);
     if (!v) return log_error_v("Unknown variable name");
     return v;
 }
 
-llvm::Value *BinaryExprAST::codegen() {
-    auto l = lhs->codegen(), r = rhs->codegen();
-    if (!l || !r) return nullptr;
+llvm::Value *CompilerSession::codegen_unary(const ExprArena &arena, const UnaryExprAST &e) {
+    auto operand_v = codegen_expr(arena, e.operand);
+    if (!operand_v) return nullptr;
+
+    auto f = get_function(operator_symbol(false, e.opcode));
+    if (!f) return log_error_v("Unknown unary operator");
+    return emit_call(f, operand_v, "unop");
+}
 
+llvm::Value *CompilerSession::emit_binary_op(char op, llvm::Value *l, llvm::Value *r) {
     switch (op) {
         case '+':
-            return BUILDER->CreateFAdd(l, r, "addtmp");
+            return builder->CreateFAdd(l, r, "addtmp");
         case '-':
-            return BUILDER->CreateFSub(l, r, "subtmp");
+            return builder->CreateFSub(l, r, "subtmp");
         case '*':
-            return BUILDER->CreateFMul(l, r, "multmp");
+            return builder->CreateFMul(l, r, "multmp");
         case '<':
-            l = BUILDER->CreateFCmpULT(l, r, "cmptmp");
+            l = builder->CreateFCmpULT(l, r, "cmptmp");
             // Convert bool 0/1 to double 0.0 or 1.0
-            return BUILDER->CreateUIToFP(l, llvm::Type::getDoubleTy(*THE_CONTEXT), "booltmp");
+            return builder->CreateUIToFP(l, llvm::Type::getDoubleTy(*context), "booltmp");
         default:
-            return log_error_v("invalid binary operator");
+            break;
     }
+
+    // If it wasn't a builtin binary operator, it must be a user defined one. Emit a call to it.
+    auto f = get_function(operator_symbol(true, op));
+    if (!f) return log_error_v("invalid binary operator");
+    return emit_call(f, {l, r}, "binop");
 }
 
-llvm::Value *CallExprAST::codegen() {
-    // Look up the name in the global module table.
-    const auto callee_f = get_function(callee);
+llvm::Value *CompilerSession::codegen_binary(const ExprArena &arena, const BinaryExprAST &e) {
+    // Binary operators are left associative, so a long chain of them is a long left spine.
+    // Walk down the spine first and emit it bottom up, instead of recursing into every lhs.
+    llvm::SmallVector<const BinaryExprAST *, 8> spine{&e};
+    while (arena[spine.back()->lhs].kind == expr_binary) spine.push_back(&arena[spine.back()->lhs].binary);
+
+    auto l = codegen_expr(arena, spine.back()->lhs);
+    if (!l) return nullptr;
+    for (auto it = spine.rbegin(); it != spine.rend(); ++it) {
+        auto r = codegen_expr(arena, (*it)->rhs);
+        if (!r || !(l = emit_binary_op((*it)->op, l, r))) return nullptr;
+    }
+    return l;
+}
+
+llvm::Value *CompilerSession::codegen_call(const ExprArena &arena, const CallExprAST &e) {
+    // Look up the name in the global module table, unless it is a builtin.
+    auto callee_f = get_intrinsic(e.callee);
+    if (!callee_f) callee_f = get_function(e.callee);
     if (!callee_f)
         return log_error_v("Unknown function referenced");
 
     // If argument mismatch error.
-    if (callee_f->arg_size() != args.size())
+    auto fi = function_protos.find(e.callee);
+    const auto proto = fi == function_protos.end() ? nullptr : fi->second.get();
+    if ((proto ? proto->get_args().size() : callee_f->arg_size()) != e.arg_count)
         return log_error_v("Incorrect # arguments passed");
 
     std::vector<llvm::Value *> args_v;
-    for (auto &arg : args) {
-        const auto c = arg->codegen();
+    const auto args = arena.args(e);
+    for (size_t i = 0; i < args.size(); ++i) {
+        // A buffer is passed on as it is, its pointer and its length.
+        if (proto && proto->is_buffer(i)) {
+            const auto &a = arena[args[i]];
+            auto buffer = a.kind == expr_variable ? buffers.lookup(a.variable) : Buffer{};
+            if (!buffer.data) return log_error_v("Expected a buffer argument");
+            args_v.push_back(buffer.data);
+            args_v.push_back(buffer.length);
+            continue;
+        }
+        const auto c = codegen_expr(arena, args[i]);
         if (!c) return nullptr;
         args_v.push_back(c);
     }
 
-    return BUILDER->CreateCall(callee_f, args_v, "calltmp");
+    return emit_call(callee_f, args_v, "calltmp");
+}
+
+llvm::CallInst *CompilerSession::emit_call(llvm::Function *callee, llvm::ArrayRef<llvm::Value *> args,
+                                           const char *name) {
+    auto call = builder->CreateCall(callee, args, name);
+    call->setCallingConv(callee->getCallingConv());
+    apply_effects(*call, *callee);
+    return call;
 }
 
-llvm::Function *PrototypeAST::codegen() {
-    // Make the function type: double(double,double,...) etc.
-    const auto ty_double = llvm::Type::getDoubleTy(*THE_CONTEXT);
-    auto ft = llvm::FunctionType::get(ty_double, std::vector<llvm::Type *>(args.size(), ty_double), false);
-    auto f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name, THE_MODULE.get());
+llvm::Function *CompilerSession::codegen(const PrototypeAST &proto) {
+    const auto &args = proto.get_args();
+    auto f = llvm::Function::Create(function_type(proto), llvm::Function::ExternalLinkage, body_name(proto),
+                                    module.get());
+    // Only Kaleidoscope code calls the body of a definition, so it need not follow the C convention.
+    if (proto.is_defined()) f->setCallingConv(llvm::CallingConv::Fast);
     // Set names for all arguments.
-    unsigned idx = 0;
-    for (auto &arg : f->args()) arg.setName(args[idx++]);
+    auto arg = f->arg_begin();
+    for (size_t i = 0; i < args.size(); ++i, ++arg) {
+        arg->setName(symbols.name(args[i]));
+        if (!proto.is_buffer(i)) continue;
+        // Elements are only ever read and written through the pointer, it is never kept.
+        arg->addAttr(llvm::Attribute::NoCapture);
+        (++arg)->setName(symbols.name(args[i]) + ".len");
+    }
+    apply_effects(*f, proto.get_effects());
     return f;
 }
 
-llvm::Function *FunctionAST::codegen() {
+llvm::Function *CompilerSession::codegen(FunctionAST &fn) {
     // Transfer ownership of the prototype to the FunctionProtos map.
-    const auto name = proto->get_name();
-    update_function_proto(std::move(proto));
-    auto the_function = get_function(name);
-    if (!the_function) return nullptr;
-
-    // Create a new basic block to start insertion into.
-    auto bb = llvm::BasicBlock::Create(*THE_CONTEXT, "entry", the_function);
-    BUILDER->SetInsertPoint(bb);
-
-    // Record the function arguments in the NamedValues map.
-    NAMED_VALUES.clear();
-    for (auto &arg : the_function->args())
-        NAMED_VALUES[std::string(arg.getName())] = &arg;
-
-    if (auto ret_val = body->codegen()) {
-        // Finish off the function.
-        BUILDER->CreateRet(ret_val);
-        // Validate the generated code, checking for consistency.
-        llvm::verifyFunction(*the_function);
-        // Run the optimizer on the function.
-#ifdef USE_OPT
-        THE_FPM->run(*the_function);
-#endif
-        return the_function;
+    // Nothing can call a top-level expression, so its prototype is not kept for later modules.
+    const auto &p = fn.get_proto();
+    const auto top_level = fn.is_top_level();
+    llvm::Function *the_function;
+    auto needs_entry = false;
+    if (top_level) {
+        the_function = codegen(p);
     } else {
+        // Code already calling an extern of the same name expects the entry point, not the body.
+        auto fi = function_protos.find(p.get_name());
+        needs_entry = fi != function_protos.end() && !fi->second->is_defined();
+        // A rejected redefinition must leave the prototype calls are checked against as it was.
+        the_function = module->getFunction(body_name(p));
+        auto mismatched = the_function ? the_function->getFunctionType() != function_type(p)
+                                       : fi != function_protos.end() && fi->second->is_defined() &&
+                                             function_type(*fi->second) != function_type(p);
+        if (mismatched) {
+            log_error("Redefinition of function with different parameters");
+            return nullptr;
+        }
+        if (the_function && !the_function->empty() && !the_function->hasAvailableExternallyLinkage()) {
+            log_error("Function cannot be redefined");
+            return nullptr;
+        }
+        auto proto = fn.take_proto();
+        proto->set_effects(infer_effects(*proto, fn.get_arena()));
+        update_function_proto(std::move(proto));
+        if (!the_function) the_function = codegen(p);
+    }
+    // A body imported for an earlier definition gives way to the new one.
+    if (the_function->hasAvailableExternallyLinkage()) {
+        the_function->deleteBody();
+        the_function->setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+    // A top-level expression runs exactly once, so a tiered JIT has no reason to count its calls.
+    if (top_level) the_function->addFnAttr(llvm::orc::KaleidoscopeJIT::TopLevelAttribute);
+
+    if (!emit_body(the_function, p, fn.get_arena(), fn.get_body())) {
         // Error reading body, remove function.
         the_function->eraseFromParent();
         return nullptr;
     }
+    if (needs_entry) emit_entry(the_function, p);
+    if (!top_level) {
+        // The operator can be used from the next item on.
+        install_operator(p);
+        if (fn.get_arena().size() <= import_budget)
+            function_bodies[p.get_name()] = {fn.take_arena(), fn.get_body()};
+        else
+            function_bodies.erase(p.get_name());
+    }
+    return the_function;
+}
+
+bool CompilerSession::emit_body(llvm::Function *f, const PrototypeAST &proto, const ExprArena &arena, ExprId body) {
+    // Create a new basic block to start insertion into.
+    auto bb = llvm::BasicBlock::Create(*context, "entry", f);
+    builder->SetInsertPoint(bb);
+
+    // Record the function arguments in the NamedValues map, and the buffers in their own.
+    named_values.clear();
+    buffers.clear();
+    const auto &args = proto.get_args();
+    auto arg = f->arg_begin();
+    for (size_t i = 0; i < args.size(); ++i, ++arg) {
+        if (!proto.is_buffer(i)) {
+            named_values[args[i]] = &*arg;
+            continue;
+        }
+        auto data = &*arg;
+        buffers[args[i]] = {data, &*++arg};
+    }
+
+    if (!emit_tail(arena, body)) {
+        f->deleteBody();
+        return false;
+    }
+    // Validate the generated code, checking for consistency.
+    // The JIT optimizes it later, right before compiling it.
+    llvm::verifyFunction(*f);
+    return true;
+}
+
+void CompilerSession::emit_entry(llvm::Function *body, const PrototypeAST &proto) {
+    entries.insert(proto.get_name());
+    // An earlier extern of the same name may have declared it already.
+    auto f = module->getFunction(symbols.name(proto.get_name()));
+    if (!f)
+        f = llvm::Function::Create(body->getFunctionType(), llvm::Function::ExternalLinkage,
+                                   symbols.name(proto.get_name()), module.get());
+    else if (!f->isDeclaration() || f->getFunctionType() != body->getFunctionType())
+        return;
+    llvm::SmallVector<llvm::Value *, 8> args;
+    for (auto &arg : f->args()) {
+        arg.setName(body->getArg(arg.getArgNo())->getName());
+        args.push_back(&arg);
+    }
+    // Keep the entry point a mere jump: only trivial bodies are inlined into it.
+    f->addFnAttr(llvm::Attribute::MinSize);
+    f->addFnAttr(llvm::Attribute::OptimizeForSize);
+    apply_effects(*f, proto.get_effects());
+
+    llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+    builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", f));
+    auto call = emit_call(body, args, "calltmp");
+    call->setTailCall();
+    builder->CreateRet(call);
+}
+
+void CompilerSession::emit_batch(llvm::Function *body, const PrototypeAST &proto) {
+    auto name = (symbols.name(proto.get_name()) + "_batch").str();
+    // Identifiers can not contain '_', so no definition or extern can take the name.
+    assert(!module->getFunction(name) && "batch entry point emitted twice");
+    batches.insert(proto.get_name());
+    // void f_batch(const double *a, const double *b, double *out, size_t n)
+    auto ty_double = llvm::Type::getDoubleTy(*context);
+    auto ty_ptr = llvm::PointerType::getUnqual(ty_double);
+    auto ty_int = llvm::Type::getInt64Ty(*context);
+    const auto &params = proto.get_args();
+    std::vector<llvm::Type *> types(params.size() + 1, ty_ptr);
+    types.push_back(ty_int);
+    auto f = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(*context), types, false),
+                                    llvm::Function::ExternalLinkage, name, module.get());
+    for (size_t i = 0; i < params.size(); ++i) {
+        f->getArg(i)->setName(symbols.name(params[i]));
+        f->getArg(i)->addAttr(llvm::Attribute::ReadOnly);
+        f->getArg(i)->addAttr(llvm::Attribute::NoCapture);
+    }
+    auto out = f->getArg(params.size()), n = f->getArg(params.size() + 1);
+    out->setName("out");
+    out->addAttr(llvm::Attribute::WriteOnly);
+    out->addAttr(llvm::Attribute::NoCapture);
+    n->setName("n");
+    f->setDoesNotThrow();
+
+    llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+    auto entry_bb = llvm::BasicBlock::Create(*context, "entry", f);
+    auto loop_bb = llvm::BasicBlock::Create(*context, "loop", f);
+    auto after_bb = llvm::BasicBlock::Create(*context, "afterloop", f);
+    builder->SetInsertPoint(entry_bb);
+    builder->CreateCondBr(builder->CreateICmpEQ(n, llvm::ConstantInt::get(ty_int, 0)), after_bb, loop_bb);
+
+    // One row a turn: the body is called on the inputs at i, and its value is stored to out[i].
+    builder->SetInsertPoint(loop_bb);
+    auto i = builder->CreatePHI(ty_int, 2, "i");
+    i->addIncoming(llvm::ConstantInt::get(ty_int, 0), entry_bb);
+    llvm::SmallVector<llvm::Value *, 8> args;
+    for (size_t j = 0; j < params.size(); ++j)
+        args.push_back(builder->CreateLoad(ty_double, builder->CreateInBoundsGEP(ty_double, f->getArg(j), i),
+                                           symbols.name(params[j])));
+    auto call = emit_call(body, args, "calltmp");
+    // The loop is only worth vectorizing with the body inlined into it.
+    call->addFnAttr(llvm::Attribute::AlwaysInline);
+    builder->CreateStore(call, builder->CreateInBoundsGEP(ty_double, out, i));
+    auto next = builder->CreateAdd(i, llvm::ConstantInt::get(ty_int, 1), "nexti", true, true);
+    i->addIncoming(next, builder->GetInsertBlock());
+    builder->CreateCondBr(builder->CreateICmpEQ(next, n), after_bb, loop_bb);
+
+    builder->SetInsertPoint(after_bb);
+    builder->CreateRetVoid();
+    llvm::verifyFunction(*f);
 }
 
-llvm::Value *IfExprAST::codegen() {
-    auto cond_v = cond->codegen();
+bool CompilerSession::emit_tail(const ExprArena &arena, ExprId id) {
+    const auto &e = arena[id];
+    if (e.kind == expr_if) {
+        // Each arm returns on its own, so calls in either one are in tail position too.
+        auto cond_v = codegen_expr(arena, e.if_.cond);
+        if (!cond_v) return false;
+        cond_v = builder->CreateFCmpONE(cond_v, llvm::ConstantFP::get(*context, llvm::APFloat(0.0)), "ifcond");
+
+        auto the_function = builder->GetInsertBlock()->getParent();
+        auto then_bb = llvm::BasicBlock::Create(*context, "then", the_function);
+        auto else_bb = llvm::BasicBlock::Create(*context, "else", the_function);
+        builder->CreateCondBr(cond_v, then_bb, else_bb);
+
+        builder->SetInsertPoint(then_bb);
+        if (!emit_tail(arena, e.if_.then)) return false;
+        builder->SetInsertPoint(else_bb);
+        return emit_tail(arena, e.if_.else_);
+    }
+
+    auto ret_val = codegen_expr(arena, id);
+    if (!ret_val) return false;
+    auto call = llvm::dyn_cast<llvm::CallInst>(ret_val);
+    if (call && !call->getCalledFunction()->isIntrinsic()) {
+        // With the same convention and parameters, the callee can always take over the caller's frame,
+        // so deep recursion runs in constant stack even without optimization.
+        auto caller = builder->GetInsertBlock()->getParent();
+        auto callee = call->getCalledFunction();
+        auto alike = callee->getCallingConv() == caller->getCallingConv() &&
+                     callee->getFunctionType() == caller->getFunctionType();
+        call->setTailCallKind(alike ? llvm::CallInst::TCK_MustTail : llvm::CallInst::TCK_Tail);
+    }
+    builder->CreateRet(ret_val);
+    return true;
+}
+
+llvm::Value *CompilerSession::codegen_if(const ExprArena &arena, const IfExprAST &e) {
+    auto cond_v = codegen_expr(arena, e.cond);
     if (!cond_v) return nullptr;
 
     // Convert condition to a bool by comparing non-equal to 0.0.
-    cond_v = BUILDER->CreateFCmpONE(cond_v, llvm::ConstantFP::get(*THE_CONTEXT, llvm::APFloat(0.0)), "ifcond");
+    cond_v = builder->CreateFCmpONE(cond_v, llvm::ConstantFP::get(*context, llvm::APFloat(0.0)), "ifcond");
 
-    auto the_function = BUILDER->GetInsertBlock()->getParent();
+    auto the_function = builder->GetInsertBlock()->getParent();
 
     // Create blocks for the then and else cases.
     // Insert the 'then' block at the end of the function.
-    auto then_bb = llvm::BasicBlock::Create(*THE_CONTEXT, "then", the_function);
-    auto else_bb = llvm::BasicBlock::Create(*THE_CONTEXT, "else");
-    auto merge_bb = llvm::BasicBlock::Create(*THE_CONTEXT, "ifcont");
+    auto then_bb = llvm::BasicBlock::Create(*context, "then", the_function);
+    auto else_bb = llvm::BasicBlock::Create(*context, "else");
+    auto merge_bb = llvm::BasicBlock::Create(*context, "ifcont");
 
-    BUILDER->CreateCondBr(cond_v, then_bb, else_bb);
+    builder->CreateCondBr(cond_v, then_bb, else_bb);
 
     // Emit then value.
-    BUILDER->SetInsertPoint(then_bb);
+    builder->SetInsertPoint(then_bb);
 
-    auto then_v = then->codegen();
+    auto then_v = codegen_expr(arena, e.then);
     if (!then_v) return nullptr;
 
-    BUILDER->CreateBr(merge_bb);
+    builder->CreateBr(merge_bb);
     // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-    then_bb = BUILDER->GetInsertBlock();
+    then_bb = builder->GetInsertBlock();
 
     // Emit else block.
     the_function->getBasicBlockList().push_back(else_bb);
-    BUILDER->SetInsertPoint(else_bb);
+    builder->SetInsertPoint(else_bb);
 
-    auto else_v = else_->codegen();
+    auto else_v = codegen_expr(arena, e.else_);
     if (!else_v) return nullptr;
 
-    BUILDER->CreateBr(merge_bb);
+    builder->CreateBr(merge_bb);
     // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
-    else_bb = BUILDER->GetInsertBlock();
+    else_bb = builder->GetInsertBlock();
 
     // Emit merge block.
     the_function->getBasicBlockList().push_back(merge_bb);
-    BUILDER->SetInsertPoint(merge_bb);
-    auto pn = BUILDER->CreatePHI(llvm::Type::getDoubleTy(*THE_CONTEXT), 2, "iftmp");
+    builder->SetInsertPoint(merge_bb);
+    auto pn = builder->CreatePHI(llvm::Type::getDoubleTy(*context), 2, "iftmp");
 
     pn->addIncoming(then_v, then_bb);
     pn->addIncoming(else_v, else_bb);
     return pn;
 }
 
-llvm::Value *ForExprAST::codegen() {
+llvm::Value *CompilerSession::codegen_index(const ExprArena &arena, const IndexExprAST &e) {
+    auto buffer = buffers.lookup(e.buffer);
+    if (!buffer.data) return log_error_v("Unknown buffer name");
+    auto index_v = codegen_expr(arena, e.index);
+    if (!index_v) return nullptr;
+    llvm::Value *value_v = nullptr;
+    if (e.value && !(value_v = codegen_expr(arena, e.value))) return nullptr;
+
+    auto ty_double = llvm::Type::getDoubleTy(*context);
+    auto ty_int = llvm::Type::getInt64Ty(*context);
+    // The variable of a counted loop is an integer converted to a double, so it is checked, and used, as that integer.
+    auto counter = llvm::dyn_cast<llvm::SIToFPInst>(index_v);
+    llvm::Value *index = counter && counter->getSrcTy() == ty_int ? counter->getOperand(0) : nullptr;
+    if (!index || !in_bounds.count({index_v, e.buffer})) {
+        llvm::Value *in;
+        if (index) {
+            in = builder->CreateICmpULT(index, buffer.length, "inbounds");
+        } else {
+            // Any other number is truncated, once it is known to be at least 0 and below the length.
+            auto zero = llvm::ConstantFP::get(ty_double, 0.0);
+            in = builder->CreateAnd(builder->CreateFCmpOGE(index_v, zero),
+                                    builder->CreateFCmpOLT(index_v, builder->CreateUIToFP(buffer.length, ty_double)),
+                                    "inbounds");
+            index = builder->CreateFPToSI(index_v, ty_int, "index");
+        }
+        auto the_function = builder->GetInsertBlock()->getParent();
+        auto trap_bb = llvm::BasicBlock::Create(*context, "outofbounds", the_function);
+        auto in_bb = llvm::BasicBlock::Create(*context, "inbounds", the_function);
+        builder->CreateCondBr(in, in_bb, trap_bb);
+        builder->SetInsertPoint(trap_bb);
+        builder->CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+        builder->CreateUnreachable();
+        builder->SetInsertPoint(in_bb);
+    }
+
+    auto element = builder->CreateInBoundsGEP(ty_double, buffer.data, index, "element");
+    if (!value_v) return builder->CreateLoad(ty_double, element, "elementval");
+    // A store is worth the value stored.
+    builder->CreateStore(value_v, element);
+    return value_v;
+}
+
+llvm::Value *CompilerSession::codegen_length(Symbol buffer) {
+    auto b = buffers.lookup(buffer);
+    if (!b.data) return log_error_v("Unknown buffer name");
+    return builder->CreateUIToFP(b.length, llvm::Type::getDoubleTy(*context), "len");
+}
+
+llvm::Value *CompilerSession::codegen_for(const ExprArena &arena, const ForExprAST &e) {
+    CountedLoop counted;
+    if (is_counted(arena, e, counted)) return codegen_counted_for(arena, e, counted);
+
     // Emit the start code first, without 'variable' in scope.
-    auto start_val = start->codegen();
+    auto start_val = codegen_expr(arena, e.start);
     if (!start_val) return nullptr;
 
     // Make the new basic block for the loop header, inserting after current block.
-    auto the_function = BUILDER->GetInsertBlock()->getParent();
-    auto preheader_bb = BUILDER->GetInsertBlock();
-    auto loop_bb = llvm::BasicBlock::Create(*THE_CONTEXT, "loop", the_function);
+    auto the_function = builder->GetInsertBlock()->getParent();
+    auto preheader_bb = builder->GetInsertBlock();
+    auto loop_bb = llvm::BasicBlock::Create(*context, "loop", the_function);
 
     // Insert an explicit fall through from the current block to the LoopBB.
-    BUILDER->CreateBr(loop_bb);
+    builder->CreateBr(loop_bb);
 
     // Start insertion in LoopBB.
-    BUILDER->SetInsertPoint(loop_bb);
+    builder->SetInsertPoint(loop_bb);
 
     // Start the PHI node with an entry for Start.
-    auto variable = BUILDER->CreatePHI(llvm::Type::getDoubleTy(*THE_CONTEXT), 2, var_name.c_str());
+    auto variable = builder->CreatePHI(llvm::Type::getDoubleTy(*context), 2, symbols.name(e.var_name));
     variable->addIncoming(start_val, preheader_bb);
 
     // Within the loop, the variable is defined equal to the PHI node.
     // If it shadows an existing variable, we have to restore it, so save it now.
-    auto [it, b] = NAMED_VALUES.insert(std::make_pair(var_name, variable));
+    auto [it, b] = named_values.try_emplace(e.var_name, variable);
     auto old_val = b ? nullptr : std::exchange(it->second, variable);
 
     // Emit the body of the loop. This, like any other expr, can change the current BB.
     // Note that we ignore the value computed by the body, but don't allow an error.
-    if (!body->codegen()) return nullptr;
+    if (!codegen_expr(arena, e.body)) return nullptr;
 
     // Emit the step value.
-    auto step_val = step ? step->codegen() : llvm::ConstantFP::get(*THE_CONTEXT, llvm::APFloat(1.0));
+    auto step_val = e.step ? codegen_expr(arena, e.step) : llvm::ConstantFP::get(*context, llvm::APFloat(1.0));
     if (!step_val) return nullptr;
 
-    auto next_var = BUILDER->CreateFAdd(variable, step_val, "nextvar");
+    auto next_var = builder->CreateFAdd(variable, step_val, "nextvar");
 
     // Compute the end condition.
-    auto end_cond = end->codegen();
+    auto end_cond = codegen_expr(arena, e.end);
     if (!end_cond) return nullptr;
 
     // Convert condition to a bool by comparing non-equal to 0.0.
-    end_cond = BUILDER->CreateFCmpONE(end_cond, llvm::ConstantFP::get(*THE_CONTEXT, llvm::APFloat(0.0)), "loopcond");
+    end_cond = builder->CreateFCmpONE(end_cond, llvm::ConstantFP::get(*context, llvm::APFloat(0.0)), "loopcond");
 
     // Create the "after loop" block and insert it.
-    auto loop_end_bb = BUILDER->GetInsertBlock();
-    auto after_bb = llvm::BasicBlock::Create(*THE_CONTEXT, "afterloop", the_function);
+    auto loop_end_bb = builder->GetInsertBlock();
+    auto after_bb = llvm::BasicBlock::Create(*context, "afterloop", the_function);
 
     // Insert the conditional branch into the end of LoopEndBB.
-    BUILDER->CreateCondBr(end_cond, loop_bb, after_bb);
+    builder->CreateCondBr(end_cond, loop_bb, after_bb);
 
     // Any new code will be inserted in AfterBB.
-    BUILDER->SetInsertPoint(after_bb);
+    builder->SetInsertPoint(after_bb);
 
     // Add a new entry to the PHI node for the backedge.
     variable->addIncoming(next_var, loop_end_bb);
 
     // Restore the unshadowed variable.
     if (old_val)
-        NAMED_VALUES[var_name] = old_val;
+        named_values[e.var_name] = old_val;
     else
-        NAMED_VALUES.erase(var_name);
+        named_values.erase(e.var_name);
 
     // for expr always returns 0.0.
-    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*THE_CONTEXT));
+    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*context));
+}
+
+/// is_invariant - Whether the expression id has the same value in every iteration of a loop over var.
+/// A call, or a user defined operator, may not.
+static bool is_invariant(const ExprArena &arena, ExprId id, Symbol var) {
+    const auto &e = arena[id];
+    switch (e.kind) {
+        case expr_number:
+            return true;
+        case expr_variable:
+            return e.variable != var;
+        case expr_length:
+            return true;
+        case expr_binary:
+            return (e.binary.op == '+' || e.binary.op == '-' || e.binary.op == '*' || e.binary.op == '<') &&
+                   is_invariant(arena, e.binary.lhs, var) && is_invariant(arena, e.binary.rhs, var);
+        default:
+            return false;
+    }
+}
+
+/// fold_constant - Compute the value of an expression made of numbers and arithmetic, like `0 - 1`.
+static bool fold_constant(const ExprArena &arena, ExprId id, double &val) {
+    const auto &e = arena[id];
+    if (e.kind == expr_number) {
+        val = e.number;
+        return true;
+    }
+    double l, r;
+    if (e.kind != expr_binary || !fold_constant(arena, e.binary.lhs, l) || !fold_constant(arena, e.binary.rhs, r))
+        return false;
+    switch (e.binary.op) {
+        case '+':
+            val = l + r;
+            return true;
+        case '-':
+            val = l - r;
+            return true;
+        case '*':
+            val = l * r;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool CompilerSession::is_counted(const ExprArena &arena, const ForExprAST &e, CountedLoop &loop) {
+    constexpr double EXACT = 9007199254740992.0;// 2^53
+    auto integral = [&](ExprId id, int64_t &val) {
+        double n;
+        if (!fold_constant(arena, id, n) || !(std::abs(n) <= EXACT) || n != std::trunc(n)) return false;
+        val = static_cast<int64_t>(n);
+        return true;
+    };
+    loop.step = 1;
+    if (!integral(e.start, loop.start) || (e.step && !integral(e.step, loop.step)) || !loop.step) return false;
+
+    const auto &end = arena[e.end];
+    if (end.kind != expr_binary || end.binary.op != '<') return false;
+    auto is_var = [&](ExprId id) { return arena[id].kind == expr_variable && arena[id].variable == e.var_name; };
+    if (is_var(end.binary.lhs) && is_invariant(arena, end.binary.rhs, e.var_name)) {
+        loop.bound = end.binary.rhs;
+        loop.below = true;
+        return true;
+    }
+    if (is_var(end.binary.rhs) && is_invariant(arena, end.binary.lhs, e.var_name)) {
+        loop.bound = end.binary.lhs;
+        loop.below = false;
+        return true;
+    }
+    return false;
+}
+
+/// indexed_by - Every buffer indexed by exactly the variable var somewhere in the expression id.
+static llvm::SmallVector<Symbol, 4> indexed_by(const ExprArena &arena, ExprId id, Symbol var) {
+    llvm::SmallVector<Symbol, 4> ans;
+    llvm::SmallVector<ExprId, 16> todo{id};
+    auto push = [&](ExprId child) {
+        if (child) todo.push_back(child);
+    };
+    while (!todo.empty()) {
+        const auto &e = arena[todo.pop_back_val()];
+        switch (e.kind) {
+            case expr_unary:
+                push(e.unary.operand);
+                break;
+            case expr_binary:
+                push(e.binary.lhs);
+                push(e.binary.rhs);
+                break;
+            case expr_call:
+                for (auto arg : arena.args(e.call)) push(arg);
+                break;
+            case expr_if:
+                push(e.if_.cond);
+                push(e.if_.then);
+                push(e.if_.else_);
+                break;
+            case expr_for:
+            case expr_pfor:
+                push(e.for_.start);
+                push(e.for_.end);
+                push(e.for_.step);
+                push(e.for_.body);
+                break;
+            case expr_index:
+            case expr_store: {
+                const auto &index = arena[e.index.index];
+                if (index.kind == expr_variable && index.variable == var && !llvm::is_contained(ans, e.index.buffer))
+                    ans.push_back(e.index.buffer);
+                push(e.index.index);
+                push(e.index.value);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return ans;
+}
+
+llvm::Value *CompilerSession::emit_limit(const ExprArena &arena, const CountedLoop &loop) {
+    auto ty_double = llvm::Type::getDoubleTy(*context);
+
+    // The bound is the same in every iteration, so it is computed once, without 'variable' in scope.
+    auto bound = codegen_expr(arena, loop.bound);
+    if (!bound) return nullptr;
+    // For an integer i, i < b exactly when i < ceil(b), and b < i when floor(b) < i.
+    // Doubles stop counting at 2^53, so the limit is kept within it, a NaN bound, which never stops a loop,
+    // going to the far end.
+    auto exact = llvm::ConstantFP::get(ty_double, 9007199254740992.0);
+    llvm::Value *limit = builder->CreateUnaryIntrinsic(loop.below ? llvm::Intrinsic::ceil : llvm::Intrinsic::floor, bound);
+    limit = loop.below ? builder->CreateMaxNum(builder->CreateMinNum(limit, exact), llvm::ConstantExpr::getFNeg(exact))
+                       : builder->CreateMinNum(builder->CreateMaxNum(limit, llvm::ConstantExpr::getFNeg(exact)), exact);
+    return builder->CreateFPToSI(limit, llvm::Type::getInt64Ty(*context), "limit");
+}
+
+llvm::Value *CompilerSession::emit_steps(const CountedLoop &loop, llvm::Value *limit) {
+    auto ty_int = llvm::Type::getInt64Ty(*context);
+    auto start = llvm::ConstantInt::get(ty_int, loop.start, true);
+    auto size = llvm::ConstantInt::get(ty_int, loop.step < 0 ? -loop.step : loop.step);
+    auto distance = loop.below ? builder->CreateSub(limit, start) : builder->CreateSub(start, limit);
+    return builder->CreateSelect(
+        builder->CreateICmpSGT(distance, llvm::ConstantInt::get(ty_int, 0)),
+        builder->CreateUDiv(builder->CreateAdd(distance, builder->CreateSub(size, llvm::ConstantInt::get(ty_int, 1))),
+                            size),
+        llvm::ConstantInt::get(ty_int, 0), "steps");
+}
+
+llvm::Value *CompilerSession::codegen_counted_for(const ExprArena &arena, const ForExprAST &e,
+                                                  const CountedLoop &loop) {
+    auto ty_int = llvm::Type::getInt64Ty(*context);
+    auto limit = emit_limit(arena, loop);
+    if (!limit) return nullptr;
+    auto start = llvm::ConstantInt::get(ty_int, loop.start, true);
+
+    // Counting away from the limit, the loop may never end, so there is no last element to check.
+    auto towards = loop.below == (loop.step > 0);
+    if (!towards || indexed_by(arena, e.body, e.var_name).empty())
+        return emit_counted_loop(arena, e, loop, start, limit, {});
+
+    // The body runs for start, start + step, ... and last, the first of them past the limit.
+    auto last = builder->CreateAdd(
+        start, builder->CreateMul(emit_steps(loop, limit), llvm::ConstantInt::get(ty_int, loop.step, true)), "last");
+    return emit_loop_versions(arena, e, loop, start, last, limit);
+}
+
+llvm::Value *CompilerSession::emit_loop_versions(const ExprArena &arena, const ForExprAST &e, const CountedLoop &loop,
+                                                 llvm::Value *first, llvm::Value *last, llvm::Value *limit) {
+    auto unchecked = indexed_by(arena, e.body, e.var_name);
+    if (unchecked.empty()) return emit_counted_loop(arena, e, loop, first, limit, {});
+
+    // Every element in between is in bounds when both ends are.
+    llvm::Value *in = builder->getTrue();
+    for (auto buffer : unchecked) {
+        auto length = buffers.lookup(buffer).length;
+        if (!length) return log_error_v("Unknown buffer name");
+        in = builder->CreateAnd(in, builder->CreateAnd(builder->CreateICmpULT(first, length),
+                                                       builder->CreateICmpULT(last, length)));
+    }
+
+    auto the_function = builder->GetInsertBlock()->getParent();
+    auto unchecked_bb = llvm::BasicBlock::Create(*context, "unchecked", the_function);
+    auto checked_bb = llvm::BasicBlock::Create(*context, "checked");
+    auto after_bb = llvm::BasicBlock::Create(*context, "afterversions");
+    builder->CreateCondBr(in, unchecked_bb, checked_bb);
+
+    builder->SetInsertPoint(unchecked_bb);
+    auto unchecked_v = emit_counted_loop(arena, e, loop, first, limit, unchecked);
+    if (!unchecked_v) return nullptr;
+    builder->CreateBr(after_bb);
+    unchecked_bb = builder->GetInsertBlock();
+
+    the_function->getBasicBlockList().push_back(checked_bb);
+    builder->SetInsertPoint(checked_bb);
+    auto checked_v = emit_counted_loop(arena, e, loop, first, limit, {});
+    if (!checked_v) return nullptr;
+    builder->CreateBr(after_bb);
+    checked_bb = builder->GetInsertBlock();
+
+    the_function->getBasicBlockList().push_back(after_bb);
+    builder->SetInsertPoint(after_bb);
+    auto pn = builder->CreatePHI(llvm::Type::getDoubleTy(*context), 2, "loopval");
+    pn->addIncoming(unchecked_v, unchecked_bb);
+    pn->addIncoming(checked_v, checked_bb);
+    return pn;
+}
+
+llvm::Value *CompilerSession::emit_counted_loop(const ExprArena &arena, const ForExprAST &e, const CountedLoop &loop,
+                                                llvm::Value *first, llvm::Value *limit,
+                                                llvm::ArrayRef<Symbol> unchecked) {
+    auto ty_double = llvm::Type::getDoubleTy(*context);
+    auto ty_int = llvm::Type::getInt64Ty(*context);
+
+    // Make the new basic block for the loop header, inserting after current block.
+    auto the_function = builder->GetInsertBlock()->getParent();
+    auto preheader_bb = builder->GetInsertBlock();
+    auto loop_bb = llvm::BasicBlock::Create(*context, "loop", the_function);
+    builder->CreateBr(loop_bb);
+    builder->SetInsertPoint(loop_bb);
+
+    auto counter = builder->CreatePHI(ty_int, 2, "counter");
+    counter->addIncoming(first, preheader_bb);
+    // The values of the iterations of a pfor are reduced as the loop goes.
+    llvm::PHINode *acc = nullptr;
+    if (e.reduction != reduce_none) {
+        acc = builder->CreatePHI(ty_double, 2, "acc");
+        auto identity = e.reduction == reduce_sum   ? 0.0
+                        : e.reduction == reduce_min ? std::numeric_limits<double>::infinity()
+                                                    : -std::numeric_limits<double>::infinity();
+        acc->addIncoming(llvm::ConstantFP::get(ty_double, identity), preheader_bb);
+    }
+    auto variable = builder->CreateSIToFP(counter, ty_double, symbols.name(e.var_name));
+
+    // If it shadows an existing variable, we have to restore it, so save it now.
+    auto [it, b] = named_values.try_emplace(e.var_name, variable);
+    auto old_val = b ? nullptr : std::exchange(it->second, variable);
+
+    // Note that we ignore the value computed by the body of a for, but don't allow an error.
+    for (auto buffer : unchecked) in_bounds.insert({variable, buffer});
+    auto body = codegen_expr(arena, e.body);
+    for (auto buffer : unchecked) in_bounds.erase({variable, buffer});
+    if (!body) return nullptr;
+    llvm::Value *next_acc = nullptr;
+    switch (e.reduction) {
+        case reduce_sum:
+            next_acc = builder->CreateFAdd(acc, body, "nextacc");
+            break;
+        case reduce_min:
+            next_acc = builder->CreateMinNum(acc, body, "nextacc");
+            break;
+        case reduce_max:
+            next_acc = builder->CreateMaxNum(acc, body, "nextacc");
+            break;
+        default:
+            break;
+    }
+
+    // Counting towards the limit, the counter stops within 2^54 of zero, far from overflowing.
+    auto towards = loop.below == (loop.step > 0);
+    auto next = builder->CreateAdd(counter, llvm::ConstantInt::get(ty_int, loop.step, true), "nextcounter",
+                                   false, towards);
+    auto end_cond = loop.below ? builder->CreateICmpSLT(counter, limit, "loopcond")
+                               : builder->CreateICmpSGT(counter, limit, "loopcond");
+
+    auto loop_end_bb = builder->GetInsertBlock();
+    auto after_bb = llvm::BasicBlock::Create(*context, "afterloop", the_function);
+    builder->CreateCondBr(end_cond, loop_bb, after_bb);
+    builder->SetInsertPoint(after_bb);
+    counter->addIncoming(next, loop_end_bb);
+    if (acc) acc->addIncoming(next_acc, loop_end_bb);
+
+    // Restore the unshadowed variable.
+    if (old_val)
+        named_values[e.var_name] = old_val;
+    else
+        named_values.erase(e.var_name);
+
+    // for expr always returns 0.0.
+    return acc ? next_acc : llvm::Constant::getNullValue(ty_double);
+}
+
+/// PFOR_MIN_TRIPS - Fewest iterations a pfor hands to the runtime, fewer run on the calling thread at once.
+constexpr int64_t PFOR_MIN_TRIPS = 64;
+
+llvm::Value *CompilerSession::codegen_pfor(const ExprArena &arena, const ForExprAST &e) {
+    CountedLoop loop;
+    if (!is_counted(arena, e, loop) || loop.below != (loop.step > 0))
+        return log_error_v("pfor needs a constant start and step, counting towards a bound the body does not change");
+    auto ty_double = llvm::Type::getDoubleTy(*context);
+    auto ty_int = llvm::Type::getInt64Ty(*context);
+    auto ty_context = llvm::Type::getInt8PtrTy(*context);
+    auto limit = emit_limit(arena, loop);
+    if (!limit) return nullptr;
+    auto trips = builder->CreateAdd(emit_steps(loop, limit), llvm::ConstantInt::get(ty_int, 1), "trips");
+
+    // Everything in scope reaches the body through a context on the stack: the numbers, then the buffers.
+    llvm::SmallVector<std::pair<Symbol, llvm::Value *>, 8> values(named_values.begin(), named_values.end());
+    llvm::SmallVector<std::pair<Symbol, Buffer>, 4> captured(buffers.begin(), buffers.end());
+    std::vector<llvm::Type *> fields(values.size(), ty_double);
+    for (size_t i = 0; i < captured.size(); ++i) {
+        fields.push_back(llvm::PointerType::getUnqual(ty_double));
+        fields.push_back(ty_int);
+    }
+    auto ty_captures = llvm::StructType::get(*context, fields);
+    auto the_function = builder->GetInsertBlock()->getParent();
+    auto &entry = the_function->getEntryBlock();
+    auto captures = llvm::IRBuilder<>(&entry, entry.begin()).CreateAlloca(ty_captures, nullptr, "captures");
+    unsigned field = 0;
+    for (auto [name, value] : values) builder->CreateStore(value, builder->CreateStructGEP(ty_captures, captures, field++));
+    for (auto [name, buffer] : captured) {
+        builder->CreateStore(buffer.data, builder->CreateStructGEP(ty_captures, captures, field++));
+        builder->CreateStore(buffer.length, builder->CreateStructGEP(ty_captures, captures, field++));
+    }
+
+    // The body goes to a function of its own, running the iterations [begin, end) of the loop.
+    auto chunk = llvm::Function::Create(llvm::FunctionType::get(ty_double, {ty_context, ty_int, ty_int}, false),
+                                        llvm::Function::InternalLinkage, the_function->getName() + ".pfor",
+                                        module.get());
+    {
+        llvm::IRBuilderBase::InsertPointGuard guard(*builder);
+        auto caller_values = std::move(named_values);
+        auto caller_buffers = std::move(buffers);
+        named_values.clear();
+        buffers.clear();
+
+        auto arg = chunk->arg_begin();
+        auto context_arg = &*arg++, begin = &*arg++, end = &*arg;
+        context_arg->setName("context");
+        begin->setName("begin");
+        end->setName("end");
+        builder->SetInsertPoint(llvm::BasicBlock::Create(*context, "entry", chunk));
+        auto context_v = builder->CreateBitCast(context_arg, llvm::PointerType::getUnqual(ty_captures));
+        field = 0;
+        for (auto [name, value] : values)
+            named_values[name] = builder->CreateLoad(ty_double, builder->CreateStructGEP(ty_captures, context_v, field++),
+                                                     symbols.name(name));
+        for (auto [name, buffer] : captured) {
+            auto data = builder->CreateLoad(fields[field], builder->CreateStructGEP(ty_captures, context_v, field));
+            ++field;
+            auto length = builder->CreateLoad(ty_int, builder->CreateStructGEP(ty_captures, context_v, field++));
+            buffers[name] = {data, length};
+        }
+        // Iteration k has its variable at start + k * step, the last one of the chunk being a limit to stop at.
+        auto start = llvm::ConstantInt::get(ty_int, loop.start, true);
+        auto step = llvm::ConstantInt::get(ty_int, loop.step, true);
+        auto first = builder->CreateAdd(start, builder->CreateMul(begin, step), "first");
+        auto last = builder->CreateAdd(
+            start, builder->CreateMul(builder->CreateSub(end, llvm::ConstantInt::get(ty_int, 1)), step), "last");
+        auto value = emit_loop_versions(arena, e, loop, first, last, last);
+        if (value) builder->CreateRet(value);
+
+        named_values = std::move(caller_values);
+        buffers = std::move(caller_buffers);
+        if (!value) {
+            chunk->eraseFromParent();
+            return nullptr;
+        }
+        llvm::verifyFunction(*chunk);
+    }
+
+    // Too few iterations to be worth waking other threads for run right here.
+    auto context_v = builder->CreateBitCast(captures, ty_context);
+    auto sequential_bb = llvm::BasicBlock::Create(*context, "sequential", the_function);
+    auto parallel_bb = llvm::BasicBlock::Create(*context, "parallel");
+    auto after_bb = llvm::BasicBlock::Create(*context, "afterpfor");
+    builder->CreateCondBr(builder->CreateICmpSLT(trips, llvm::ConstantInt::get(ty_int, PFOR_MIN_TRIPS)),
+                          sequential_bb, parallel_bb);
+
+    builder->SetInsertPoint(sequential_bb);
+    auto sequential_v = builder->CreateCall(chunk, {context_v, llvm::ConstantInt::get(ty_int, 0), trips}, "pfortmp");
+    builder->CreateBr(after_bb);
+
+    the_function->getBasicBlockList().push_back(parallel_bb);
+    builder->SetInsertPoint(parallel_bb);
+    auto ty_i32 = llvm::Type::getInt32Ty(*context);
+    auto runtime = module->getOrInsertFunction(
+        "__kaleido_parallel_for",
+        llvm::FunctionType::get(ty_double, {chunk->getType(), ty_context, ty_int, ty_i32}, false));
+    auto parallel_v = builder->CreateCall(runtime, {chunk, context_v, trips, llvm::ConstantInt::get(ty_i32, e.reduction)},
+                                          "pfortmp");
+    parallel_v->setDoesNotThrow();
+    builder->CreateBr(after_bb);
+
+    the_function->getBasicBlockList().push_back(after_bb);
+    builder->SetInsertPoint(after_bb);
+    auto pn = builder->CreatePHI(ty_double, 2, "pforval");
+    pn->addIncoming(sequential_v, sequential_bb);
+    pn->addIncoming(parallel_v, parallel_bb);
+    return pn;
+}
+
+/// codegen_expr - Dispatch on the kind of the node.
+llvm::Value *CompilerSession::codegen_expr(const ExprArena &arena, ExprId id) {
+    const auto &e = arena[id];
+    switch (e.kind) {
+        case expr_number:
+            return codegen_number(e.number);
+        case expr_variable:
+            return codegen_variable(e.variable);
+        case expr_unary:
+            return codegen_unary(arena, e.unary);
+        case expr_binary:
+            return codegen_binary(arena, e.binary);
+        case expr_call:
+            return codegen_call(arena, e.call);
+        case expr_if:
+            return codegen_if(arena, e.if_);
+        case expr_for:
+            return codegen_for(arena, e.for_);
+        case expr_pfor:
+            return codegen_pfor(arena, e.for_);
+        case expr_index:
+        case expr_store:
+            return codegen_index(arena, e.index);
+        case expr_length:
+            return codegen_length(e.variable);
+    }
+    return log_error_v("unknown expression kind");
 }
@@ -0,0 +1,153 @@
+#include "session.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Intrinsics.h"
+
+/// KnownExtern - A function of the C math library: pure, always returning,
+/// and lowered to an LLVM intrinsic if there is one, so it can be folded and vectorized.
+/// They may set errno, but nothing in Kaleidoscope ever reads it.
+struct KnownExtern {
+    unsigned arity;
+    llvm::Intrinsic::ID intrinsic;
+};
+
+static const llvm::StringMap<KnownExtern> KNOWN_EXTERNS = {
+    {"sin", {1, llvm::Intrinsic::sin}},
+    {"cos", {1, llvm::Intrinsic::cos}},
+    {"exp", {1, llvm::Intrinsic::exp}},
+    {"exp2", {1, llvm::Intrinsic::exp2}},
+    {"log", {1, llvm::Intrinsic::log}},
+    {"log2", {1, llvm::Intrinsic::log2}},
+    {"log10", {1, llvm::Intrinsic::log10}},
+    {"sqrt", {1, llvm::Intrinsic::sqrt}},
+    {"fabs", {1, llvm::Intrinsic::fabs}},
+    {"floor", {1, llvm::Intrinsic::floor}},
+    {"ceil", {1, llvm::Intrinsic::ceil}},
+    {"trunc", {1, llvm::Intrinsic::trunc}},
+    {"round", {1, llvm::Intrinsic::round}},
+    {"rint", {1, llvm::Intrinsic::rint}},
+    {"pow", {2, llvm::Intrinsic::pow}},
+    {"fmin", {2, llvm::Intrinsic::minnum}},
+    {"fmax", {2, llvm::Intrinsic::maxnum}},
+    {"copysign", {2, llvm::Intrinsic::copysign}},
+    {"tan", {1, llvm::Intrinsic::not_intrinsic}},
+    {"asin", {1, llvm::Intrinsic::not_intrinsic}},
+    {"acos", {1, llvm::Intrinsic::not_intrinsic}},
+    {"atan", {1, llvm::Intrinsic::not_intrinsic}},
+    {"sinh", {1, llvm::Intrinsic::not_intrinsic}},
+    {"cosh", {1, llvm::Intrinsic::not_intrinsic}},
+    {"tanh", {1, llvm::Intrinsic::not_intrinsic}},
+    {"expm1", {1, llvm::Intrinsic::not_intrinsic}},
+    {"log1p", {1, llvm::Intrinsic::not_intrinsic}},
+    {"cbrt", {1, llvm::Intrinsic::not_intrinsic}},
+    {"atan2", {2, llvm::Intrinsic::not_intrinsic}},
+    {"fmod", {2, llvm::Intrinsic::not_intrinsic}},
+    {"hypot", {2, llvm::Intrinsic::not_intrinsic}},
+};
+
+void CompilerSession::describe_extern(PrototypeAST &proto) {
+    auto it = KNOWN_EXTERNS.find(symbols.name(proto.get_name()));
+    if (it == KNOWN_EXTERNS.end() || it->second.arity != proto.get_args().size() || proto.has_buffers()) return;
+    proto.set_effects({true, true, true, true, true});
+    proto.set_intrinsic(it->second.intrinsic);
+}
+
+/// is_builtin - Whether a binary operator is emitted as an instruction, rather than a call.
+static bool is_builtin(char op) {
+    return op == '+' || op == '-' || op == '*' || op == '<';
+}
+
+/// counts_up - Whether a for loop is sure to end: counting up from a constant, by a constant step of at least 1,
+/// while its variable is below a constant. Doubles are exact enough below 2^53 for every step to move it.
+static bool counts_up(const ExprArena &arena, const ForExprAST &e) {
+    constexpr double EXACT = 9007199254740992.0;// 2^53
+    auto &start = arena[e.start];
+    auto &end = arena[e.end];
+    if (start.kind != expr_number || !(start.number >= -EXACT)) return false;
+    if (e.step) {
+        auto &step = arena[e.step];
+        if (step.kind != expr_number || !(step.number >= 1)) return false;
+    }
+    if (end.kind != expr_binary || end.binary.op != '<') return false;
+    auto &var = arena[end.binary.lhs];
+    auto &bound = arena[end.binary.rhs];
+    return var.kind == expr_variable && var.variable == e.var_name &&
+           bound.kind == expr_number && bound.number <= EXACT;
+}
+
+Effects CompilerSession::infer_effects(const PrototypeAST &proto, const ExprArena &arena) {
+    // Start from the best, and give up what any node of the body can not promise.
+    Effects ans{true, true, true, true, true};
+    auto call = [&](Symbol callee) {
+        // A recursive call does no more than the function itself, but may never return.
+        if (callee == proto.get_name()) {
+            ans.terminates = false;
+            return;
+        }
+        auto fi = function_protos.find(callee);
+        auto e = fi == function_protos.end() ? Effects{} : fi->second->get_effects();
+        ans.pure &= e.pure;
+        ans.nounwind &= e.nounwind;
+        ans.terminates &= e.terminates;
+        ans.readonly &= e.readonly;
+        ans.argmem &= e.argmem;
+    };
+    // Every node of the arena belongs to the body.
+    for (ExprId id = 1; id <= arena.size(); ++id) {
+        auto &node = arena[id];
+        switch (node.kind) {
+            case expr_unary:
+                call(operator_symbol(false, node.unary.opcode));
+                break;
+            case expr_binary:
+                if (!is_builtin(node.binary.op)) call(operator_symbol(true, node.binary.op));
+                break;
+            case expr_call:
+                call(node.call.callee);
+                break;
+            case expr_for:
+                if (!counts_up(arena, node.for_)) ans.terminates = false;
+                break;
+            // The runtime running the iterations synchronizes threads through memory of its own.
+            case expr_pfor:
+                ans.pure = ans.readonly = ans.argmem = ans.terminates = false;
+                break;
+            // Elements are only ever those of the buffers passed in, and one out of bounds traps.
+            case expr_index:
+                ans.pure = ans.terminates = false;
+                break;
+            case expr_store:
+                ans.pure = ans.readonly = ans.terminates = false;
+                break;
+            default:
+                break;
+        }
+    }
+    return ans;
+}
+
+void CompilerSession::apply_effects(llvm::Function &f, const Effects &e) {
+    if (e.pure) {
+        f.setDoesNotAccessMemory();
+    } else {
+        if (e.readonly) f.setOnlyReadsMemory();
+        if (e.argmem) f.setOnlyAccessesArgMemory();
+    }
+    if (e.nounwind) f.setDoesNotThrow();
+    if (e.terminates) f.addFnAttr(llvm::Attribute::WillReturn);
+    // Floating point math has no undefined behavior, so a pure function that always returns can run anywhere.
+    if (e.pure && e.nounwind && e.terminates) f.addFnAttr(llvm::Attribute::Speculatable);
+}
+
+void CompilerSession::apply_effects(llvm::CallBase &call, const llvm::Function &callee) {
+    if (callee.doesNotAccessMemory()) {
+        call.setDoesNotAccessMemory();
+    } else {
+        if (callee.onlyReadsMemory()) call.setOnlyReadsMemory();
+        if (callee.onlyAccessesArgMemory()) call.setOnlyAccessesArgMemory();
+    }
+    if (callee.doesNotThrow()) call.setDoesNotThrow();
+    if (callee.hasFnAttribute(llvm::Attribute::WillReturn)) call.addFnAttr(llvm::Attribute::WillReturn);
+}
@@ -0,0 +1,294 @@
+#include "kaleidoscope.h"
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/X86TargetParser.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <cctype>
+#include <initializer_list>
+#include <iterator>
+#include <mutex>
+
+/// initialize_native_target - Set up the host target, once for the whole process.
+static void initialize_native_target() {
+    static std::once_flag native_target;
+    std::call_once(native_target, [] {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+    });
+}
+
+llvm::Expected<std::unique_ptr<llvm::orc::KaleidoscopeJIT>> create_jit(
+    const llvm::orc::KaleidoscopeJITOptions &options) {
+    initialize_native_target();
+    return llvm::orc::KaleidoscopeJIT::Create(options);
+}
+
+llvm::Expected<std::unique_ptr<Program>> Program::compile(llvm::orc::KaleidoscopeJIT &jit, std::string source) {
+    auto program = std::unique_ptr<Program>(new Program);
+    program->source = std::move(source);
+
+    auto session = CompilerSession::create(jit, Lexer::from_string(program->source), program->diagnostics);
+    if (!session) return session.takeError();
+    program->session = std::move(*session);
+
+    auto exprs = program->session->compile_all();
+    if (!exprs) return exprs.takeError();
+    if (program->session->get_error_count())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), program->diagnostics.str());
+
+    program->results.reserve(exprs->size());
+    for (auto fp : *exprs) program->results.push_back(fp());
+    return program;
+}
+
+llvm::Expected<uint64_t> Program::lookup_batch(std::string_view name, size_t arity) {
+    auto proto = session->get_prototype(name);
+    if (proto && !proto->has_buffers() && proto->get_args().size() != arity)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       std::string(name) + " takes " + std::to_string(proto->get_args().size()) +
+                                           " arguments, not " + std::to_string(arity));
+    auto symbol = session->lookup_batch(llvm::StringRef(name.data(), name.size()));
+    if (!symbol) return symbol.takeError();
+    return symbol->getAddress();
+}
+
+void for_chunks(size_t n, llvm::function_ref<void(size_t begin, size_t end)> chunk) {
+    // A chunk is big enough to be worth waking another thread for.
+    constexpr size_t MIN_CHUNK = 4096;
+    if (n < 2 * MIN_CHUNK) {
+        if (n) chunk(0, n);
+        return;
+    }
+    // The rows go to the threads pfor runs on, MIN_CHUNK of them for each range the runtime splits.
+    auto run = [](void *context, int64_t begin, int64_t end) {
+        auto &[chunk, n] = *static_cast<std::pair<llvm::function_ref<void(size_t, size_t)>, size_t> *>(context);
+        chunk(begin * MIN_CHUNK, std::min<size_t>(end * MIN_CHUNK, n));
+        return 0.0;
+    };
+    std::pair<llvm::function_ref<void(size_t, size_t)>, size_t> context{chunk, n};
+    __kaleido_parallel_for(run, &context, static_cast<int64_t>((n + MIN_CHUNK - 1) / MIN_CHUNK), reduce_none);
+}
+
+/// describe_parameters - Spell out parameters, as PARAMETER codes them, like "(double, double *, size_t)".
+static std::string describe_parameters(std::string_view parameters) {
+    std::string ans = "(";
+    for (auto c : parameters) {
+        if (ans.size() > 1) ans += ", ";
+        ans += c == 'd' ? "double" : c == 'p' ? "double *" : "size_t";
+    }
+    return ans + ")";
+}
+
+llvm::Expected<uint64_t> Program::lookup(std::string_view name, std::string_view parameters) {
+    auto proto = session->get_prototype(name);
+    if (!proto)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "no function named " + std::string(name));
+    std::string expected;
+    for (size_t i = 0; i < proto->get_args().size(); ++i) expected += proto->is_buffer(i) ? "pn" : "d";
+    if (expected != parameters)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       std::string(name) + " takes " + describe_parameters(expected) + ", not " +
+                                           describe_parameters(parameters));
+    auto symbol = session->lookup(llvm::StringRef(name.data(), name.size()));
+    if (!symbol) return symbol.takeError();
+    return symbol->getAddress();
+}
+
+/// write_header - Declare every function module defines, for C and C++ code linking the object.
+/// An operator has no name C could call it by, so it is left out.
+static llvm::Error write_header(const llvm::Module &module, const std::string &path) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_Text);
+    if (ec) return llvm::createFileError(path, ec);
+
+    std::string guard;
+    for (auto c : llvm::sys::path::filename(path)) guard += std::isalnum(static_cast<unsigned char>(c)) ? std::toupper(c) : '_';
+    out << "#ifndef __" << guard << "__\n"
+        << "#define __" << guard << "__\n\n"
+        << "#include <stddef.h>\n\n"
+        << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+    for (auto &fn : module) {
+        if (fn.isDeclaration()) continue;
+        auto name = fn.getName();
+        if (!std::all_of(name.begin(), name.end(), [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; }))
+            continue;
+        out << (fn.getReturnType()->isVoidTy() ? "void " : "double ") << name << '(';
+        // A buffer is its elements and their count, named like a and a_len. A batch only reads its inputs.
+        for (auto &arg : fn.args()) {
+            auto type = arg.getType()->isPointerTy() ? arg.onlyReadsMemory() ? "const double *" : "double *"
+                      : arg.getType()->isIntegerTy() ? "size_t "
+                                                     : "double ";
+            auto arg_name = arg.getName().str();
+            std::replace(arg_name.begin(), arg_name.end(), '.', '_');
+            out << (arg.getArgNo() ? ", " : "") << type << arg_name;
+        }
+        out << (fn.arg_empty() ? "void" : "") << ");\n";
+    }
+    out << "\n#ifdef __cplusplus\n}\n#endif\n\n"
+        << "#endif// __" << guard << "__\n";
+    out.close();
+    if (out.has_error()) return llvm::createFileError(path, out.error());
+    return llvm::Error::success();
+}
+
+/// Version - A copy of every definition, for the CPUs with some features.
+struct Version {
+    const char *suffix;
+    std::initializer_list<llvm::StringRef> features;
+};
+/// VERSIONS - Copies made by multiversion, from the least to the most demanding.
+static const Version VERSIONS[] = {
+    {".avx2", {"avx2", "fma", "bmi", "bmi2"}},
+    {".avx512", {"avx2", "fma", "bmi", "bmi2", "avx512f", "avx512vl", "avx512bw", "avx512dq", "avx512cd"}},
+};
+
+/// multiversion - Give every function module defines a copy for each of VERSIONS, calling the copies of the same version,
+/// and turn each symbol it exports into an ifunc that picks the best copy the CPU supports when the object is loaded.
+/// The original body is kept for any other CPU.
+static llvm::Error multiversion(llvm::Module &module, const llvm::TargetMachine &tm) {
+    auto &triple = tm.getTargetTriple();
+    if (triple.getArch() != llvm::Triple::x86_64 || !triple.isOSBinFormatELF())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "multiversioning needs an x86-64 ELF target");
+
+    std::vector<llvm::Function *> defs;
+    for (auto &fn : module)
+        if (!fn.isDeclaration()) defs.push_back(&fn);
+
+    std::vector<std::vector<llvm::Function *>> copies;
+    for (auto &version : VERSIONS) {
+        auto features = tm.getTargetFeatureString().str();
+        for (auto feature : version.features) {
+            features += features.empty() ? "+" : ",+";
+            features += feature.str();
+        }
+
+        auto &fns = copies.emplace_back();
+        llvm::ValueToValueMapTy vmap;
+        for (auto *fn : defs) {
+            fns.push_back(llvm::Function::Create(fn->getFunctionType(), llvm::Function::InternalLinkage,
+                                                 fn->getName() + version.suffix, module));
+            vmap[fn] = fns.back();
+        }
+        for (size_t i = 0; i < defs.size(); ++i) {
+            auto copy_arg = fns[i]->arg_begin();
+            for (auto &arg : defs[i]->args()) {
+                copy_arg->setName(arg.getName());
+                vmap[&arg] = &*copy_arg++;
+            }
+            llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+            llvm::CloneFunctionInto(fns[i], defs[i], vmap, llvm::CloneFunctionChangeType::LocalChangesOnly, returns);
+            fns[i]->addFnAttr("target-features", features);
+        }
+    }
+
+    // The resolvers run before constructors, so they set up __cpu_model themselves, as compilers do.
+    auto &context = module.getContext();
+    auto *i32 = llvm::Type::getInt32Ty(context);
+    auto *cpu_model_type = llvm::StructType::get(context, {i32, i32, i32, llvm::ArrayType::get(i32, 1)});
+    auto *cpu_model = module.getOrInsertGlobal("__cpu_model", cpu_model_type);
+    auto cpu_init = module.getOrInsertFunction("__cpu_indicator_init", llvm::Type::getVoidTy(context));
+    llvm::IRBuilder<> builder(context);
+    for (size_t i = 0; i < defs.size(); ++i) {
+        auto *fn = defs[i];
+        if (!fn->hasExternalLinkage()) continue;
+        auto name = fn->getName().str();
+        fn->setName(name + ".default");
+        fn->setLinkage(llvm::Function::InternalLinkage);
+
+        auto *resolver = llvm::Function::Create(llvm::FunctionType::get(fn->getType(), false),
+                                                llvm::Function::InternalLinkage, name + ".resolver", module);
+        builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", resolver));
+        builder.CreateCall(cpu_init);
+        auto *cpu_features = builder.CreateLoad(
+            i32, builder.CreateInBoundsGEP(cpu_model_type, cpu_model,
+                                           {builder.getInt32(0), builder.getInt32(3), builder.getInt32(0)}));
+        llvm::Value *best = fn;
+        for (size_t v = 0; v < std::size(VERSIONS); ++v) {
+            auto mask = builder.getInt32(static_cast<uint32_t>(llvm::X86::getCpuSupportsMask(VERSIONS[v].features)));
+            auto *supported = builder.CreateICmpEQ(builder.CreateAnd(cpu_features, mask), mask);
+            best = builder.CreateSelect(supported, copies[v][i], best);
+        }
+        builder.CreateRet(best);
+
+        llvm::GlobalIFunc::create(fn->getFunctionType(), fn->getAddressSpace(), llvm::Function::ExternalLinkage, name,
+                                  resolver, &module);
+    }
+    return llvm::Error::success();
+}
+
+llvm::Error compile_aot(std::unique_ptr<Lexer> lexer, const AotOutputs &outputs, const AotOptions &options,
+                        std::ostream &diagnostics) {
+    initialize_native_target();
+    // Multiversioned code starts from a baseline any x86-64 runs, unless told otherwise.
+    auto cpu = options.multiversion && options.cpu.empty() ? "x86-64" : options.cpu;
+    auto jtmb = llvm::orc::KaleidoscopeJIT::createTargetMachineBuilder(llvm::Triple(llvm::sys::getProcessTriple()),
+                                                                      cpu, options.features);
+    // The object may be linked into a position independent executable or a shared library,
+    // by a linker that keeps it within reach of the rest, unlike the JIT.
+    jtmb.setRelocationModel(llvm::Reloc::PIC_);
+    jtmb.setCodeModel(llvm::CodeModel::Small);
+    auto tm = jtmb.createTargetMachine();
+    if (!tm) return tm.takeError();
+
+    auto session = CompilerSession::create((*tm)->createDataLayout(), std::move(lexer), diagnostics);
+    session->set_fast_math(options.fast_math);
+    auto tsm = session->compile_module(options.batch);
+    if (session->get_error_count())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "the input has errors");
+    auto &module = *tsm.getModuleUnlocked();
+    module.setTargetTriple((*tm)->getTargetTriple().str());
+
+    if (!outputs.header.empty())
+        if (auto err = write_header(module, outputs.header)) return err;
+    if (options.multiversion)
+        if (auto err = multiversion(module, **tm)) return err;
+
+    auto optimizer = llvm::orc::ModuleOptimizer::Create(jtmb, llvm::orc::ModuleOptimizer::getLevel(options.opt_level),
+                                                        options.passes);
+    if (!optimizer) return optimizer.takeError();
+    if (auto err = (*optimizer)->run(module)) return err;
+
+    if (!outputs.bitcode.empty()) {
+        std::error_code ec;
+        llvm::raw_fd_ostream out(outputs.bitcode, ec);
+        if (ec) return llvm::createFileError(outputs.bitcode, ec);
+        llvm::WriteBitcodeToFile(module, out);
+    }
+    if (outputs.object.empty() && outputs.library.empty()) return llvm::Error::success();
+
+    // Codegen still runs on the legacy pass manager.
+    llvm::SmallVector<char, 0> object;
+    llvm::raw_svector_ostream object_out(object);
+    llvm::legacy::PassManager codegen;
+    if ((*tm)->addPassesToEmitFile(codegen, object_out, nullptr, llvm::CGFT_ObjectFile))
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "the target can not emit an object file");
+    codegen.run(module);
+    llvm::StringRef bytes(object.data(), object.size());
+
+    if (!outputs.object.empty()) {
+        std::error_code ec;
+        llvm::raw_fd_ostream out(outputs.object, ec);
+        if (ec) return llvm::createFileError(outputs.object, ec);
+        out << bytes;
+    }
+    if (!outputs.library.empty()) {
+        auto member_name = llvm::sys::path::stem(outputs.library).str() + ".o";
+        llvm::NewArchiveMember member(llvm::MemoryBufferRef(bytes, member_name));
+        auto kind = (*tm)->getTargetTriple().isOSDarwin() ? llvm::object::Archive::K_DARWIN
+                                                          : llvm::object::Archive::K_GNU;
+        if (auto err = llvm::writeArchive(outputs.library, member, true, kind, true, false)) return err;
+    }
+    return llvm::Error::success();
+}
@@ -0,0 +1,140 @@
+#ifndef __KALEIDOSCOPE_H__
+#define __KALEIDOSCOPE_H__
+
+#include "session.h"
+
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/Support/Error.h"
+
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/// create_jit - Set up the native target on first use, and create a JIT to compile programs with.
+llvm::Expected<std::unique_ptr<llvm::orc::KaleidoscopeJIT>> create_jit(
+    const llvm::orc::KaleidoscopeJITOptions &options = {});
+
+/// AotOutputs - Files compile_aot writes, each one left out if its path is empty.
+struct AotOutputs {
+    std::string object; // native object file
+    std::string library;// static library holding the object
+    std::string header; // C header declaring every definition
+    std::string bitcode;// optimized bitcode, for link-time optimization
+};
+
+/// AotOptions - How compile_aot compiles.
+struct AotOptions {
+    unsigned opt_level = 2;
+    std::string passes;  // pipeline run instead of the opt_level one if not empty
+    std::string cpu;     // CPU to compile for, the host's if empty
+    std::string features;// features turned on or off over those of the CPU, like +avx2,-avx512f
+    /// Compile each definition three times, for the CPU, for AVX2 and for AVX-512,
+    /// and pick the best the machine running it supports when the object is loaded.
+    /// Without a cpu, the first one is for any x86-64. Only on x86-64 ELF targets.
+    bool multiversion = false;
+    bool fast_math = false;// see CompilerSession::set_fast_math
+    bool batch = false;    // also define f_batch for every definition f without buffers, see CompilerSession::emit_batch
+};
+
+/// compile_aot - Compile the definitions read by lexer, as options say, and write them out.
+/// Top-level expressions are left out.
+/// Any error in the input fails the compilation, after it is reported to diagnostics.
+llvm::Error compile_aot(std::unique_ptr<Lexer> lexer, const AotOutputs &outputs, const AotOptions &options = {},
+                        std::ostream &diagnostics = std::cerr);
+
+/// PARAMETER - How a C++ parameter type is passed to Kaleidoscope code, 0 if it can not be:
+/// 'd' a number, 'p' the elements of a buffer, and 'n' their count, right after them.
+template<class T>
+inline constexpr char PARAMETER = 0;
+template<>
+inline constexpr char PARAMETER<double> = 'd';
+template<>
+inline constexpr char PARAMETER<double *> = 'p';
+template<>
+inline constexpr char PARAMETER<size_t> = 'n';
+
+/// Signature - What a C++ function type must look like to call Kaleidoscope code through it:
+/// every value in Kaleidoscope is a double, and a buffer is a pointer to doubles followed by their count.
+template<class F>
+struct Signature : std::false_type {};
+template<class... Args>
+struct Signature<double(Args...)> : std::bool_constant<((PARAMETER<Args> != 0) && ...)> {
+    static constexpr char parameters[] = {PARAMETER<Args>..., 0};
+};
+
+/// for_chunks - Split n rows into chunks, and call chunk on each of them, on the threads pfor runs on, see runtime.h.
+/// Too few rows to be worth a thread are left to the calling thread, in a single chunk.
+void for_chunks(size_t n, llvm::function_ref<void(size_t begin, size_t end)> chunk);
+
+/// Batch - A definition evaluated over arrays of arguments, through its batch entry point.
+/// Like `batch(a, b, out, n)`, which sets out[i] to f(a[i], b[i]) for every i below n.
+template<class F>
+class Batch;
+template<class... Args>
+class Batch<double(Args...)> {
+public:
+    using Fn = void(const Args *..., double *, size_t);
+
+    explicit Batch(Fn *fn) : fn(fn) {}
+    inline void operator()(const Args *...inputs, double *out, size_t n) const { fn(inputs..., out, n); }
+    /// parallel - Do the same, with the rows split across cores.
+    void parallel(const Args *...inputs, double *out, size_t n) const {
+        for_chunks(n, [&](size_t begin, size_t end) { fn((inputs + begin)..., out + begin, end - begin); });
+    }
+
+private:
+    Fn *fn;
+};
+
+/// Program - Source compiled once, whose functions are then called directly, like any C function.
+/// Compiling runs the top-level expressions once, in order, and keeps their values.
+/// The functions can be called from any number of threads, as long as the program is alive:
+/// destroying it frees their code.
+class Program {
+    std::string source;// scanned in place by the session's lexer
+    std::ostringstream diagnostics;
+    std::unique_ptr<CompilerSession> session;
+    std::vector<double> results;
+
+    Program() = default;
+    llvm::Expected<uint64_t> lookup(std::string_view name, std::string_view parameters);
+    llvm::Expected<uint64_t> lookup_batch(std::string_view name, size_t arity);
+
+public:
+    /// compile - Compile every item of source into a session of its own in jit, which must outlive the program.
+    /// Any error in the input fails the whole program, with the errors reported as the message.
+    static llvm::Expected<std::unique_ptr<Program>> compile(llvm::orc::KaleidoscopeJIT &jit, std::string source);
+
+    /// get_results - Values of the top-level expressions, in source order.
+    inline const std::vector<double> &get_results() const { return results; }
+
+    /// get_function - Find the function called name, and return it as a plain function pointer,
+    /// like `program->get_function<double(double, double)>("f")`.
+    /// The parameters must match its definition, a `double *` and a `size_t` for each buffer,
+    /// like `double(double *, size_t)` for `def sum(a[])`. The elements are used in place, never copied.
+    template<class F>
+    llvm::Expected<F *> get_function(std::string_view name) {
+        static_assert(Signature<F>::value, "Kaleidoscope functions take doubles and buffers, and return doubles only");
+        auto address = lookup(name, Signature<F>::parameters);
+        if (!address) return address.takeError();
+        return reinterpret_cast<F *>(*address);
+    }
+
+    /// get_batch - Find the definition called name, which takes no buffers, and return it to be evaluated in batches,
+    /// like `program->get_batch<double(double, double)>("f")`. Its batch entry point is compiled the first time.
+    template<class F>
+    llvm::Expected<Batch<F>> get_batch(std::string_view name) {
+        static_assert(Signature<F>::value && std::string_view(Signature<F>::parameters).find_first_not_of('d') ==
+                                                 std::string_view::npos,
+                      "Kaleidoscope functions are evaluated in batches over doubles only");
+        auto address = lookup_batch(name, std::string_view(Signature<F>::parameters).size());
+        if (!address) return address.takeError();
+        return Batch<F>(reinterpret_cast<typename Batch<F>::Fn *>(*address));
+    }
+};
+
+#endif// __KALEIDOSCOPE_H__
@@ -1,55 +1,168 @@
 #include "lexer.h"
 
 #include <cctype>
-#include <utility>
-
-std::string IDENTIFIER_STR;
-double NUM_VAL;
-
-int get_token() {
-    static int LAST_CHAR = ' ';
-    // Skip any whitespace.
-    while (isspace(LAST_CHAR)) LAST_CHAR = getchar();
-    // Identifier: [a-zA-Z][a-zA-Z0-9]*
-    if (isalpha(LAST_CHAR)) {
-        std::string str;
-        do {
-            str += std::exchange(LAST_CHAR, getchar());
-        } while (isalnum(LAST_CHAR));
-
-        IDENTIFIER_STR = std::move(str);
-        return IDENTIFIER_STR == "extern" ? tok_extern
-               : IDENTIFIER_STR == "def"  ? tok_def
-               : IDENTIFIER_STR == "if"   ? tok_if
-               : IDENTIFIER_STR == "then" ? tok_then
-               : IDENTIFIER_STR == "else" ? tok_else
-               : IDENTIFIER_STR == "for"  ? tok_for
-               : IDENTIFIER_STR == "in"   ? tok_in
-                                          : tok_identifier;
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// BLOCK_SIZE - Size of a single read from a source that cannot be mapped.
+constexpr static size_t BLOCK_SIZE = 64 * 1024;
+
+std::unique_ptr<Lexer> Lexer::from_stdin() {
+    return from_fd(STDIN_FILENO, false);
+}
+
+std::unique_ptr<Lexer> Lexer::from_file(const char *path) {
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    return from_fd(fd, true);
+}
+
+std::unique_ptr<Lexer> Lexer::from_string(std::string_view source) {
+    auto lexer = std::unique_ptr<Lexer>(new Lexer);
+    lexer->attach(source.data(), source.size());
+    return lexer;
+}
+
+/// from_fd - Map fd if it is a regular file, otherwise set the lexer up to read it.
+std::unique_ptr<Lexer> Lexer::from_fd(int fd, bool owned) {
+    auto lexer = std::unique_ptr<Lexer>(new Lexer);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // An empty file can not be mapped, and has no token anyway.
+        if (st.st_size == 0) {
+            if (owned) close(fd);
+            return lexer;
+        }
+        auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            if (owned) close(fd);
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            lexer->attach(static_cast<const char *>(p), st.st_size);
+            lexer->owns_mapping = true;
+            return lexer;
+        }
     }
-    // Number: [0-9.]+
-    if (isdigit(LAST_CHAR) || LAST_CHAR == '.') {
-        std::string str;
-        do {
-            str += std::exchange(LAST_CHAR, getchar());
-        } while (isdigit(LAST_CHAR) || LAST_CHAR == '.');
-
-        NUM_VAL = strtod(str.c_str(), nullptr);
-        return tok_number;
+    lexer->attach(fd, owned);
+    return lexer;
+}
+
+void Lexer::attach(const char *data, size_t size) {
+    mapped = data;
+    mapped_size = size;
+    token = cur = data;
+    end = data + size;
+}
+
+void Lexer::attach(int fd_, bool owned) {
+    fd = fd_;
+    owns_fd = owned;
+    capacity = BLOCK_SIZE;
+    storage = std::make_unique<char[]>(capacity);
+    token = cur = end = storage.get();
+}
+
+Lexer::~Lexer() {
+    if (owns_mapping) munmap(const_cast<char *>(mapped), mapped_size);
+    if (fd >= 0 && owns_fd) close(fd);
+}
+
+/// fill - Read the next block behind the token being scanned.
+/// Bytes before the token are dropped, so the buffer only grows for a token larger than itself.
+bool Lexer::fill() {
+    if (fd < 0) return false;
+
+    auto keep = static_cast<size_t>(end - token);
+    auto offset = static_cast<size_t>(cur - token);
+    if (keep == capacity) {
+        auto grown = std::make_unique<char[]>(capacity *= 2);
+        memcpy(grown.get(), token, keep);
+        storage = std::move(grown);
+    } else if (keep) {
+        memmove(storage.get(), token, keep);
     }
-    // Comment until end of line.
-    if (LAST_CHAR == '#')
-        while (true)
-            switch (LAST_CHAR = getchar()) {
-                case EOF:
-                    return tok_eof;
-                case '\r':
-                case '\n':
-                    return get_token();
+    token = storage.get();
+    cur = token + offset;
+
+    ssize_t n;
+    do n = read(fd, storage.get() + keep, capacity - keep);
+    while (n < 0 && errno == EINTR);
+
+    end = token + keep + (n > 0 ? n : 0);
+    if (n > 0) return true;
+    // End of input, or an error we can not recover from.
+    if (owns_fd) close(fd);
+    fd = -1;
+    return false;
+}
+
+/// keyword - Tell a keyword from an identifier by its length and first char,
+/// so any identifier costs at most one string compare.
+static int keyword(std::string_view str) {
+    auto is = [str](std::string_view kw, int tok) { return str == kw ? tok : tok_identifier; };
+    switch (str.size()) {
+        case 2:
+            return str[1] == 'f' ? is("if", tok_if) : is("in", tok_in);
+        case 3:
+            return str[0] == 'd' ? is("def", tok_def) : is("for", tok_for);
+        case 4:
+            switch (str[0]) {
+                case 't':
+                    return is("then", tok_then);
+                case 'e':
+                    return is("else", tok_else);
                 default:
-                    break;
+                    return is("pfor", tok_pfor);
             }
-    // Check for end of file. Don't eat the EOF.
-    // Otherwise, just return the character as its ascii value.
-    return LAST_CHAR == EOF ? tok_eof : std::exchange(LAST_CHAR, getchar());
+        case 5:
+            return is("unary", tok_unary);
+        case 6:
+            return str[0] == 'e' ? is("extern", tok_extern) : is("binary", tok_binary);
+        default:
+            return tok_identifier;
+    }
+}
+
+int Lexer::peek() {
+    return cur != end || fill() ? static_cast<unsigned char>(*cur) : EOF;
+}
+
+int Lexer::next() {
+    while (true) {
+        int c;
+        // Skip any whitespace.
+        while (token = cur, isspace(c = peek())) ++cur;
+        // Identifier: [a-zA-Z][a-zA-Z0-9]*
+        if (isalpha(c)) {
+            do ++cur;
+            while (isalnum(peek()));
+
+            return keyword(identifier());
+        }
+        // Number: [0-9.]+
+        if (isdigit(c) || c == '.') {
+            do ++cur;
+            while (isdigit(c = peek()) || c == '.');
+
+            // Like strtod, take the longest prefix that is a number, or 0 if there is none.
+            num_val = 0;
+            std::from_chars(token, cur, num_val);
+            return tok_number;
+        }
+        // Comment until end of line.
+        if (c == '#') {
+            do token = ++cur;
+            while ((c = peek()) != EOF && c != '\r' && c != '\n');
+            if (c != EOF) continue;
+        }
+        // Check for end of file. Don't eat the EOF.
+        // Otherwise, just return the character as its ascii value.
+        if (c == EOF) return tok_eof;
+        ++cur;
+        return c;
+    }
 }
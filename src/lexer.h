@@ -1,7 +1,9 @@
 #ifndef __LEXER_H__
 #define __LEXER_H__
 
-#include <string>
+#include <cstddef>
+#include <memory>
+#include <string_view>
 
 /// The lexer returns tokens [0-255] if it is an unknown character,
 /// otherwise one of these for known things.
@@ -22,12 +24,59 @@ enum Token {
     tok_else = -8,
     tok_for = -9,
     tok_in = -10,
+    tok_pfor = -13,
+
+    // operators
+    tok_binary = -11,
+    tok_unary = -12,
 };
 
-extern std::string IDENTIFIER_STR;// Filled in if tok_identifier
-extern double NUM_VAL;            // Filled in if tok_number
+/// Lexer - Splits a source into tokens.
+/// A file is memory-mapped and scanned in place, standard input is read in large blocks,
+/// and a string is scanned where the caller keeps it.
+/// Token text is a view into the buffer, so no token ever allocates.
+/// Each instance owns its own buffer, so any number of lexers can be alive at once.
+class Lexer {
+    std::unique_ptr<char[]> storage;// read buffer, null if the source is mapped
+    size_t capacity = 0;
+    const char *mapped = nullptr;// mapped file or string, null if the source is read
+    size_t mapped_size = 0;
+    bool owns_mapping = false;   // whether mapped is a file to unmap
+    int fd = -1;                 // file to read from, -1 once exhausted
+    bool owns_fd = false;
+
+    const char *token = nullptr, *cur = nullptr, *end = nullptr;
+    double num_val = 0;
+
+    Lexer() = default;
+    static std::unique_ptr<Lexer> from_fd(int fd, bool owned);
+    void attach(const char *data, size_t size);
+    void attach(int fd, bool owned);
+    bool fill();
+    int peek();
+
+public:
+    /// from_stdin - Map standard input if it is redirected from a file, otherwise read it block by block.
+    static std::unique_ptr<Lexer> from_stdin();
+    /// from_file - Map the whole file into memory, or return null if it cannot be opened.
+    /// Something that is not a regular file, like a pipe, is read block by block instead.
+    static std::unique_ptr<Lexer> from_file(const char *path);
+    /// from_string - Scan source in place. It is not copied, so it must outlive the lexer.
+    static std::unique_ptr<Lexer> from_string(std::string_view source);
 
-/// get_token - Return the next token from standard input.
-int get_token();
+    ~Lexer();
+    Lexer(const Lexer &) = delete;
+    Lexer &operator=(const Lexer &) = delete;
+
+    /// next - Return the next token.
+    int next();
+
+    /// Filled in if tok_identifier.
+    /// The view lives as long as the lexer for a mapped file or a string,
+    /// and until the next call to next() for a read source.
+    inline std::string_view identifier() const { return {token, static_cast<size_t>(cur - token)}; }
+    /// Filled in if tok_number.
+    inline double number() const { return num_val; }
+};
 
 #endif// __LEXER_H__
@@ -1,92 +1,323 @@
-#include "ast.h"
-#include "lexer.h"
+#include "kaleidoscope.h"
 
-#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_os_ostream.h"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
-/// top ::= definition | external | expression | ';'
-int main() {
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();
+static llvm::cl::OptionCategory OPTIONS("try-llvm options");
+
+static llvm::cl::list<std::string> INPUTS(
+    llvm::cl::Positional,
+    llvm::cl::desc("[input files...]"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<bool> BATCH(
+    "batch",
+    llvm::cl::desc("Compile the whole input at once, then run its top-level expressions in order"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<unsigned> JOBS(
+    "jobs",
+    llvm::cl::desc("Number of threads compiling modules in parallel, 0 to compile on the main thread"),
+    llvm::cl::init(llvm::heavyweight_hardware_concurrency().compute_thread_count()),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<unsigned> OPT_LEVEL(
+    "O",
+    llvm::cl::desc("Optimization level of the pipeline run over every module, -O0 to -O3 (default -O0)"),
+    llvm::cl::Prefix,
+    llvm::cl::init(0),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> PASSES(
+    "passes",
+    llvm::cl::desc("Pipeline run over every module instead of the -O one, like opt -passes= takes"),
+    llvm::cl::value_desc("pipeline"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<unsigned> IMPORT_BUDGET(
+    "import-budget",
+    llvm::cl::desc("Largest definition, in expression nodes, copied into later modules calling it for inlining"),
+    llvm::cl::init(64),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<bool> FAST_MATH(
+    "fast-math",
+    llvm::cl::desc("Let the optimizer reassociate arithmetic and fuse multiplies with adds, "
+                   "which may change results in the last bits"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<bool> LAZY(
+    "lazy",
+    llvm::cl::desc("Compile each function only when it is first called"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<bool> TIERED(
+    "tiered",
+    llvm::cl::desc("Compile functions without optimization first, and recompile the hot ones optimized"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<uint64_t> HOT_THRESHOLD(
+    "hot-threshold",
+    llvm::cl::desc("Number of calls after which a function is hot in tiered mode"),
+    llvm::cl::init(1000),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<unsigned> TIER_UP_LEVEL(
+    "tier-up-level",
+    llvm::cl::desc("Optimization level, 2 or 3, hot functions are recompiled at in tiered mode"),
+    llvm::cl::init(2),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> CACHE_DIR(
+    "cache-dir",
+    llvm::cl::desc("Directory keeping compiled objects, so later runs load them instead of compiling again"),
+    llvm::cl::value_desc("dir"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<unsigned> SLAB_SIZE(
+    "slab-size",
+    llvm::cl::desc("KiB of code, and of data, in each slab compiled objects are packed into, 0 to map pages for each object"),
+    llvm::cl::value_desc("KiB"),
+    llvm::cl::init(4096),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> EMIT_OBJ(
+    "emit-obj",
+    llvm::cl::desc("Compile the definitions ahead of time into a native object file, instead of running the input"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> EMIT_LIB(
+    "emit-lib",
+    llvm::cl::desc("Compile the definitions ahead of time into a static library, instead of running the input"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> EMIT_HEADER(
+    "emit-header",
+    llvm::cl::desc("Write a C header declaring the definitions compiled ahead of time"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> EMIT_BC(
+    "emit-bc",
+    llvm::cl::desc("Write the definitions compiled ahead of time as optimized bitcode, for link-time optimization"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<bool> VECTOR_MATH(
+    "vector-math",
+    llvm::cl::desc("Let the loop vectorizer call the vector math library of the host, if there is one (default on)"),
+    llvm::cl::init(true),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> MCPU(
+    "mcpu",
+    llvm::cl::desc("CPU to compile for, like skylake-avx512 (default: the host CPU)"),
+    llvm::cl::value_desc("cpu"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<std::string> MATTR(
+    "mattr",
+    llvm::cl::desc("Features to turn on or off over those of the CPU, like +avx2,-avx512f"),
+    llvm::cl::value_desc("features"),
+    llvm::cl::cat(OPTIONS));
 
-    std::cout << "ready> ";
-    std::cout.flush();
-    get_next_token();
+static llvm::cl::opt<bool> MULTIVERSION(
+    "multiversion",
+    llvm::cl::desc("Compile ahead of time each definition for baseline x86-64, AVX2 and AVX-512, "
+                   "picking the best one the CPU supports when the object is loaded"),
+    llvm::cl::cat(OPTIONS));
 
-    THE_JIT = EXIT_ON_ERROR(llvm::orc::KaleidoscopeJIT::Create());
-    initialize_module_and_pass_manager();
+static llvm::cl::opt<bool> EMIT_BATCH(
+    "emit-batch",
+    llvm::cl::desc("Also define f_batch(a, b, out, n) for each definition f(a b) compiled ahead of time, "
+                   "evaluating it over arrays of arguments in a loop it is inlined into"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<bool> PRINT_MEMORY(
+    "print-memory",
+    llvm::cl::desc("Print the bytes of code and data the JIT holds after each top-level expression"),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::cl::opt<unsigned> SHARDS(
+    "shards",
+    llvm::cl::desc("Number of modules the definitions are spread over in batch mode"),
+    llvm::cl::init(1),
+    llvm::cl::cat(OPTIONS));
+
+static llvm::ExitOnError EXIT_ON_ERROR;
+static std::unique_ptr<llvm::orc::KaleidoscopeJIT> THE_JIT;
+
+/// print_memory - Report what the JIT holds for a session, if asked to.
+static void print_memory(CompilerSession &session) {
+    if (!PRINT_MEMORY) return;
+    auto usage = THE_JIT->getMemoryUsage(session.get_dylib());
+    std::cerr << "JIT memory: " << usage.Code << " bytes of code, " << usage.Data << " bytes of data" << std::endl;
+}
+
+/// run_repl - Compile and run the input item by item.
+/// top ::= definition | external | expression | ';'
+static int run_repl(CompilerSession &session, std::ostream &out) {
+    llvm::raw_os_ostream ir_out(out);
+    out << "ready> ";
+    out.flush();
+    session.get_next_token();
 
     while (true) {
-        std::cout << "ready> ";
-        std::cout.flush();
-        switch (CURRENT_TOKEN) {
+        out << "ready> ";
+        out.flush();
+        switch (session.token()) {
             case tok_eof:
                 return 0;
 
             case ';':
-                get_next_token();
+                session.get_next_token();
                 break;// ignore top-level semicolons.
 
             case tok_def:
-                if (auto fn_ast = parse_definition()) {
-                    if (auto fn_ir = fn_ast->codegen()) {
-                        std::cout << "Parsed a function definition:" << std::endl;
-                        fn_ir->print(llvm::outs());
-                        std::cout << std::endl;
-                        update_module_and_pass_manager();
+                if (auto fn_ast = session.parse_definition()) {
+                    if (auto fn_ir = session.codegen(*fn_ast)) {
+                        out << "Parsed a function definition:" << std::endl;
+                        fn_ir->print(ir_out);
+                        ir_out.flush();
+                        out << std::endl;
+                        EXIT_ON_ERROR(session.update_module());
                     }
                 }
                 // Skip token for error recovery.
                 else
-                    get_next_token();
+                    session.get_next_token();
                 break;
 
             case tok_extern:
-                if (auto proto_ast = parse_extern()) {
-                    if (auto fn_ir = proto_ast->codegen()) {
-                        std::cout << "Parsed an extern:" << std::endl;
-                        fn_ir->print(llvm::outs());
-                        std::cout << std::endl;
-                        update_function_proto(std::move(proto_ast));
+                if (auto proto_ast = session.parse_extern()) {
+                    if (auto fn_ir = session.codegen(*proto_ast)) {
+                        out << "Parsed an extern:" << std::endl;
+                        fn_ir->print(ir_out);
+                        ir_out.flush();
+                        out << std::endl;
+                        session.update_function_proto(std::move(proto_ast));
                     }
                 }
                 // Skip token for error recovery.
                 else
-                    get_next_token();
+                    session.get_next_token();
                 break;
 
             default:
                 // Evaluate a top-level expression into an anonymous function.
-                if (auto fn_ast = parse_top_level_expr()) {
-                    if (auto fn_ir = fn_ast->codegen()) {
-                        std::cout << "Parsed a top-level expr:" << std::endl;
-                        fn_ir->print(llvm::outs());
-                        std::cout << std::endl;
+                if (auto fn_ast = session.parse_top_level_expr()) {
+                    if (auto fn_ir = session.codegen(*fn_ast)) {
+                        out << "Parsed a top-level expr:" << std::endl;
+                        fn_ir->print(ir_out);
+                        ir_out.flush();
+                        out << std::endl;
+                        auto name = fn_ir->getName().str();
 
                         // Create a ResourceTracker to track JIT'd memory allocated to our
                         // anonymous expression -- that way we can free it after executing.
-                        auto rt = THE_JIT->getMainJITDylib().createResourceTracker();
+                        auto rt = session.get_dylib().createResourceTracker();
 
-                        update_module_and_pass_manager();
+                        EXIT_ON_ERROR(session.update_module(rt));
 
-                        // Search the JIT for the __anon_expr symbol.
-                        auto expr_symbol = EXIT_ON_ERROR(THE_JIT->lookup("__anon_expr"));
+                        // Search the JIT for the anonymous expression symbol.
+                        auto expr_symbol = EXIT_ON_ERROR(session.lookup(name));
 
                         // Get the symbol's address and cast it to the right type (takes no
                         // arguments, returns a double) so we can call it as a native function.
                         auto fp = (double (*)()) expr_symbol.getAddress();
-                        std::cout << "Evaluated to " << fp() << std::endl;
+                        out << "Evaluated to " << fp() << std::endl;
 
-                        // Delete the anonymous expression module from the JIT.
-                        EXIT_ON_ERROR(rt->remove());
+                        // Delete the anonymous expression module from the JIT,
+                        // once the compile thread that emitted it is done with its tracker.
+                        EXIT_ON_ERROR(THE_JIT->remove(*rt));
+                        print_memory(session);
                     }
                 }
                 // Skip token for error recovery.
                 else
-                    get_next_token();
+                    session.get_next_token();
                 break;
         }
     }
 }
+
+/// run_batch - Compile the whole input at once, then run its top-level expressions in source order.
+static int run_batch(CompilerSession &session, std::ostream &out) {
+    auto exprs = EXIT_ON_ERROR(session.compile_all(SHARDS));
+    for (auto fp : exprs) out << "Evaluated to " << fp() << std::endl;
+    print_memory(session);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    llvm::cl::HideUnrelatedOptions(OPTIONS);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT compiler\n");
+
+    // Read the files named on the command line, or standard input if there is none.
+    if (INPUTS.empty()) INPUTS.push_back("-");
+    std::vector<std::unique_ptr<Lexer>> lexers;
+    for (auto &input : INPUTS) {
+        lexers.push_back(input == "-" ? Lexer::from_stdin() : Lexer::from_file(input.c_str()));
+        if (!lexers.back()) {
+            std::cerr << "error: can not open " << input << std::endl;
+            return 1;
+        }
+    }
+
+    AotOutputs aot{EMIT_OBJ, EMIT_LIB, EMIT_HEADER, EMIT_BC};
+    if (!aot.object.empty() || !aot.library.empty() || !aot.header.empty() || !aot.bitcode.empty()) {
+        if (lexers.size() != 1) {
+            std::cerr << "error: ahead of time compilation takes a single input" << std::endl;
+            return 1;
+        }
+        EXIT_ON_ERROR(compile_aot(std::move(lexers.front()), aot, {OPT_LEVEL, PASSES, MCPU, MATTR, MULTIVERSION, FAST_MATH, EMIT_BATCH}));
+        return 0;
+    }
+
+    if (LAZY && TIERED) {
+        std::cerr << "error: --lazy and --tiered can not be combined" << std::endl;
+        return 1;
+    }
+    llvm::orc::KaleidoscopeJITOptions options;
+    options.NumCompileThreads = JOBS;
+    options.OptLevel = OPT_LEVEL;
+    options.Passes = PASSES;
+    options.Lazy = LAZY;
+    options.Tiered = TIERED;
+    options.HotThreshold = HOT_THRESHOLD;
+    options.TierUpLevel = TIER_UP_LEVEL;
+    options.CacheDir = CACHE_DIR;
+    options.SlabSize = size_t(SLAB_SIZE) << 10;
+    options.VectorMath = VECTOR_MATH;
+    options.CPU = MCPU;
+    options.Features = MATTR;
+    THE_JIT = EXIT_ON_ERROR(create_jit(options));
+
+    auto run = [](std::unique_ptr<Lexer> lexer, std::ostream &out) {
+        auto session = EXIT_ON_ERROR(CompilerSession::create(*THE_JIT, std::move(lexer)));
+        // Without an optimizer, an imported body would never be inlined.
+        session->set_import_budget(OPT_LEVEL || !PASSES.empty() || TIERED ? IMPORT_BUDGET : 0);
+        session->set_fast_math(FAST_MATH);
+        return BATCH ? run_batch(*session, out) : run_repl(*session, out);
+    };
+    if (lexers.size() == 1) return run(std::move(lexers.front()), std::cout);
+
+    // Several inputs are compiled and run at once, each in a session of its own.
+    // Their outputs are kept apart, and printed in the order the inputs were given.
+    std::vector<std::ostringstream> outs(lexers.size());
+    std::vector<int> results(lexers.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < lexers.size(); ++i)
+        threads.emplace_back([&, i] { results[i] = run(std::move(lexers[i]), outs[i]); });
+    for (auto &thread : threads) thread.join();
+    for (auto &out : outs) std::cout << out.str();
+    return *std::max_element(results.begin(), results.end());
+}
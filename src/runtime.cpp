@@ -0,0 +1,193 @@
+#include "runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+    /// Loop - One call to __kaleido_parallel_for, while its iterations run.
+    struct Loop {
+        double (*chunk)(void *, int64_t, int64_t);
+        void *context;
+        int32_t reduction;
+        int64_t grain;                 // most iterations a thread runs without splitting some off
+        std::atomic<int64_t> remaining;// iterations yet to run
+        std::mutex mutex;              // guards result
+        double result;
+    };
+
+    /// identity - Value of a loop with no iteration.
+    double identity(int32_t reduction) {
+        switch (reduction) {
+            case reduce_min:
+                return std::numeric_limits<double>::infinity();
+            case reduce_max:
+                return -std::numeric_limits<double>::infinity();
+            default:
+                return 0;
+        }
+    }
+
+    /// combine - Reduce two values, as llvm.minnum and llvm.maxnum do for min and max.
+    double combine(int32_t reduction, double a, double b) {
+        switch (reduction) {
+            case reduce_sum:
+                return a + b;
+            case reduce_min:
+                return std::fmin(a, b);
+            case reduce_max:
+                return std::fmax(a, b);
+            default:
+                return 0;
+        }
+    }
+
+    /// Range - Iterations [begin, end) of a loop, a task any thread can run.
+    struct Range {
+        Loop *loop;
+        int64_t begin, end;
+    };
+
+    /// Deque - Ranges its owner pushes and pops at the back, the most recently split and smallest first,
+    /// while other threads steal from the front, where the largest are.
+    class Deque {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+
+    public:
+        void push(Range r) {
+            std::lock_guard lock(mutex);
+            ranges.push_back(r);
+        }
+        bool pop(Range &r) {
+            std::lock_guard lock(mutex);
+            if (ranges.empty()) return false;
+            r = ranges.back();
+            ranges.pop_back();
+            return true;
+        }
+        bool steal(Range &r) {
+            std::lock_guard lock(mutex);
+            if (ranges.empty()) return false;
+            r = ranges.front();
+            ranges.pop_front();
+            return true;
+        }
+    };
+
+    /// Pool - One thread for each core but the first, each with a deque,
+    /// and one more deque shared by every other thread, which runs ranges too while its own loop is not done.
+    class Pool {
+        std::vector<std::unique_ptr<Deque>> deques;
+        std::vector<std::thread> workers;
+        std::atomic<int64_t> queued{0};// ranges in any deque
+        bool stopping = false;         // guarded by sleep_mutex
+        std::mutex sleep_mutex;
+        std::condition_variable wake;
+
+        static inline thread_local size_t self = SIZE_MAX;// deque of this thread, SIZE_MAX outside the pool
+
+        Deque &own() { return *deques[std::min(self, workers.size())]; }
+
+        void push(Range r) {
+            own().push(r);
+            queued.fetch_add(1);
+            // Taking the lock orders the count before a worker going to sleep checks it.
+            { std::lock_guard lock(sleep_mutex); }
+            wake.notify_one();
+        }
+
+        /// find - Take a range from this thread's deque, or steal one from another.
+        bool find(Range &r) {
+            if (!queued.load(std::memory_order_relaxed)) return false;
+            auto first = std::min(self, workers.size());
+            for (size_t i = 0; i < deques.size(); ++i) {
+                auto &d = *deques[(first + i) % deques.size()];
+                if (i ? d.steal(r) : d.pop(r)) {
+                    queued.fetch_sub(1);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// run - Run a range, after splitting halves off the back for other threads while it is too large.
+        void run(Range r) {
+            auto &loop = *r.loop;
+            while (r.end - r.begin > loop.grain) {
+                auto mid = r.begin + (r.end - r.begin) / 2;
+                push({&loop, mid, r.end});
+                r.end = mid;
+            }
+            auto value = loop.chunk(loop.context, r.begin, r.end);
+            if (loop.reduction != reduce_none) {
+                std::lock_guard lock(loop.mutex);
+                loop.result = combine(loop.reduction, loop.result, value);
+            }
+            // The loop may be gone as soon as this hits 0.
+            loop.remaining.fetch_sub(r.end - r.begin, std::memory_order_acq_rel);
+        }
+
+        void work(size_t i) {
+            self = i;
+            while (true) {
+                Range r;
+                if (find(r)) {
+                    run(r);
+                    continue;
+                }
+                std::unique_lock lock(sleep_mutex);
+                wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+                if (stopping) return;
+            }
+        }
+
+    public:
+        Pool() {
+            auto threads = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned i = 0; i < threads; ++i) deques.push_back(std::make_unique<Deque>());
+            for (unsigned i = 0; i + 1 < threads; ++i) workers.emplace_back([this, i] { work(i); });
+        }
+        ~Pool() {
+            {
+                std::lock_guard lock(sleep_mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &t : workers) t.join();
+        }
+
+        double parallel_for(double (*chunk)(void *, int64_t, int64_t), void *context, int64_t count,
+                            int32_t reduction) {
+            if (count <= 0) return identity(reduction);
+            // A few ranges for each thread even out iterations of uneven cost.
+            auto grain = std::max<int64_t>(1, count / (static_cast<int64_t>(deques.size()) * 8));
+            if (workers.empty() || count <= grain) return chunk(context, 0, count);
+
+            Loop loop{chunk, context, reduction, grain, {count}, {}, identity(reduction)};
+            run({&loop, 0, count});
+            // Help with whatever is left, of this loop or any other, rather than only waiting.
+            while (loop.remaining.load(std::memory_order_acquire) > 0) {
+                Range r;
+                if (find(r))
+                    run(r);
+                else
+                    std::this_thread::yield();
+            }
+            return loop.result;
+        }
+    };
+}// namespace
+
+double __kaleido_parallel_for(double (*chunk)(void *context, int64_t begin, int64_t end), void *context,
+                              int64_t count, int32_t reduction) {
+    static Pool pool;
+    return pool.parallel_for(chunk, context, count, reduction);
+}
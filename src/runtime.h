@@ -0,0 +1,30 @@
+#ifndef __RUNTIME_H__
+#define __RUNTIME_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Reduction - How the values of the iterations of a pfor combine into the value of the loop.
+enum Reduction {
+    reduce_none,// the loop is worth 0, like a for
+    reduce_sum,
+    reduce_min,
+    reduce_max,
+};
+
+/// __kaleido_parallel_for - Run the iterations [0, count) of a pfor, and reduce their values as reduction says.
+/// chunk runs the iterations [begin, end) in order and returns their reduced value, context being what it needs.
+/// Ranges of iterations are split off and stolen by a pool of threads started on the first call,
+/// and the calling thread runs its share too, until every iteration has run.
+/// A pfor inside a pfor runs on the same threads.
+double __kaleido_parallel_for(double (*chunk)(void *context, int64_t begin, int64_t end), void *context,
+                              int64_t count, int32_t reduction);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif// __RUNTIME_H__
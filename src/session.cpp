@@ -0,0 +1,164 @@
+﻿#include "session.h"
+
+#include <algorithm>
+#include <atomic>
+
+llvm::Expected<std::unique_ptr<CompilerSession>> CompilerSession::create(llvm::orc::KaleidoscopeJIT &jit,
+                                                                         std::unique_ptr<Lexer> lexer,
+                                                                         std::ostream &diagnostics) {
+    // JITDylib names must be unique in the execution session.
+    static std::atomic<unsigned> session_count{0};
+    auto dylib = jit.createJITDylib("session." + std::to_string(session_count++));
+    if (!dylib) return dylib.takeError();
+    return std::unique_ptr<CompilerSession>(
+        new CompilerSession(&jit, &*dylib, jit.getDataLayout(), std::move(lexer), diagnostics));
+}
+
+std::unique_ptr<CompilerSession> CompilerSession::create(const llvm::DataLayout &data_layout,
+                                                         std::unique_ptr<Lexer> lexer,
+                                                         std::ostream &diagnostics) {
+    return std::unique_ptr<CompilerSession>(
+        new CompilerSession(nullptr, nullptr, data_layout, std::move(lexer), diagnostics));
+}
+
+CompilerSession::CompilerSession(llvm::orc::KaleidoscopeJIT *jit, llvm::orc::JITDylib *dylib,
+                                 llvm::DataLayout data_layout, std::unique_ptr<Lexer> lexer,
+                                 std::ostream &diagnostics)
+    : jit(jit), dylib(dylib), data_layout(std::move(data_layout)), diagnostics(diagnostics), lexer(std::move(lexer)) {
+    initialize_module();
+}
+
+CompilerSession::~CompilerSession() {
+    if (!jit) return;
+    // This waits for the dylib's code to be emitted, even code no lookup waited for, but for no other session's.
+    if (auto err = jit->removeJITDylib(*dylib)) llvm::logAllUnhandledErrors(std::move(err), llvm::errs(), "error: ");
+}
+
+llvm::Expected<llvm::JITEvaluatedSymbol> CompilerSession::lookup(llvm::StringRef name) {
+    auto fi = function_protos.find(symbols.intern(name));
+    if (fi != function_protos.end() && fi->second->is_defined() && !entries.count(fi->first)) {
+        emit_entry(get_function(fi->first), *fi->second);
+        if (auto err = update_module()) return err;
+    }
+    return jit->lookup(*dylib, name);
+}
+
+llvm::Expected<llvm::JITEvaluatedSymbol> CompilerSession::lookup_batch(llvm::StringRef name) {
+    auto fi = function_protos.find(symbols.intern(name));
+    if (fi == function_protos.end() || !fi->second->is_defined() || fi->second->has_buffers())
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "no definition named " + name.str() +
+                                                                           " without buffers to evaluate in batches");
+    if (!batches.count(fi->first)) {
+        emit_batch(get_function(fi->first), *fi->second);
+        if (auto err = update_module()) return err;
+    }
+    return jit->lookup(*dylib, (name + "_batch").str());
+}
+
+llvm::Expected<std::vector<llvm::JITEvaluatedSymbol>> CompilerSession::lookup_all(llvm::ArrayRef<std::string> names) {
+    return jit->lookupAll(*dylib, names);
+}
+
+std::vector<CompilerSession::Item> CompilerSession::parse_items() {
+    std::vector<Item> items;
+    get_next_token();
+    while (token() != tok_eof) {
+        switch (token()) {
+            case ';':
+                get_next_token();
+                continue;
+            // Nothing is emitted before the whole input is parsed, so an operator is known from its item on.
+            case tok_def:
+                if (auto fn_ast = parse_definition()) {
+                    install_operator(fn_ast->get_proto());
+                    items.push_back({std::move(fn_ast), nullptr, false});
+                    continue;
+                }
+                break;
+            case tok_extern:
+                if (auto proto_ast = parse_extern()) {
+                    install_operator(*proto_ast);
+                    items.push_back({nullptr, std::move(proto_ast), false});
+                    continue;
+                }
+                break;
+            default:
+                if (auto fn_ast = parse_top_level_expr()) {
+                    items.push_back({std::move(fn_ast), nullptr, true});
+                    continue;
+                }
+                break;
+        }
+        // Skip token for error recovery.
+        get_next_token();
+    }
+    return items;
+}
+
+llvm::Expected<std::vector<double (*)()>> CompilerSession::compile_all(unsigned shards) {
+    auto items = parse_items();
+    auto def_count = std::count_if(items.begin(), items.end(), [](auto &item) { return item.fn && !item.is_expr; });
+
+    // Definitions are spread evenly, top-level expressions go with the shard that is open.
+    shards = std::max(1u, shards);
+    auto shard_size = (static_cast<size_t>(def_count) + shards - 1) / shards;
+    size_t in_shard = 0;
+    std::vector<std::string> defs, exprs;
+    for (auto &item : items) {
+        if (item.proto) {
+            update_function_proto(std::move(item.proto));
+            continue;
+        }
+        auto fn_ir = codegen(*item.fn);
+        item.fn.reset();
+        if (!fn_ir) continue;
+        if (item.is_expr) {
+            exprs.push_back(fn_ir->getName().str());
+            continue;
+        }
+        defs.push_back(fn_ir->getName().str());
+        if (++in_shard == shard_size) {
+            if (auto err = update_module()) return err;
+            in_shard = 0;
+        }
+    }
+    if (auto err = update_module()) return err;
+
+    // Materialize every shard with a single lookup, so they are all compiled in parallel,
+    // instead of one after another as calls between them are discovered.
+    auto names = std::move(exprs);
+    auto expr_count = names.size();
+    names.insert(names.end(), defs.begin(), defs.end());
+    auto addresses = lookup_all(names);
+    if (!addresses) return addresses.takeError();
+    std::vector<double (*)()> ans(expr_count);
+    for (size_t i = 0; i < expr_count; ++i)
+        ans[i] = (double (*)())(*addresses)[i].getAddress();
+    return ans;
+}
+
+const PrototypeAST *CompilerSession::get_prototype(std::string_view name) {
+    auto fi = function_protos.find(symbols.intern(name));
+    return fi == function_protos.end() ? nullptr : fi->second.get();
+}
+
+llvm::orc::ThreadSafeModule CompilerSession::compile_module(bool batch) {
+    for (auto &item : parse_items()) {
+        if (item.proto)
+            update_function_proto(std::move(item.proto));
+        else if (!item.is_expr) {
+            // Every definition is part of the object's interface.
+            auto name = item.fn->get_proto().get_name();
+            auto f = codegen(*item.fn);
+            if (!f) continue;
+            auto &proto = *function_protos[name];
+            emit_entry(f, proto);
+            if (batch && !proto.has_buffers()) emit_batch(f, proto);
+        }
+    }
+    // Nothing outside the module calls the bodies of definitions, only their entry points.
+    for (auto &[name, proto] : function_protos)
+        if (auto f = module->getFunction(body_name(*proto)); f && proto->is_defined() && !f->isDeclaration())
+            f->setLinkage(llvm::GlobalValue::InternalLinkage);
+    return take_module();
+}
@@ -0,0 +1,250 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include "KaleidoscopeJIT.h"
+#include "ast.h"
+#include "lexer.h"
+#include "symbol.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// CompilerSession - Everything it takes to compile one input: the lexer, the parser and codegen state,
+/// and a JITDylib of its own, where the code it compiles goes.
+/// Sessions share nothing but the JIT, so any number of them can compile and run on different threads at once.
+/// A session without a JIT compiles ahead of time: its modules are taken out, not run.
+/// A session itself is used by one thread at a time.
+class CompilerSession {
+    // Both null in a session compiling ahead of time.
+    llvm::orc::KaleidoscopeJIT *jit;
+    llvm::orc::JITDylib *dylib;
+    llvm::DataLayout data_layout;
+    std::ostream &diagnostics;// where errors in the input are reported
+    unsigned error_count = 0;
+
+    // Parser state.
+    std::unique_ptr<Lexer> lexer;
+    int current_token = 0;
+    ExprArena item_arena;                    // where the nodes of the top-level item being parsed go
+    std::array<int8_t, 256> binop_precedence = builtin_precedence();// precedence of each binary operator defined, -1 for any other char
+    std::array<bool, 256> unary_ops{};       // which chars are defined as unary operators
+    unsigned anon_count = 0;
+    const PrototypeAST *parsing_proto = nullptr;// the definition whose body is being parsed, null if none
+    SymbolTable symbols;
+
+    // Codegen state.
+    std::unique_ptr<llvm::LLVMContext> context;
+    std::unique_ptr<llvm::Module> module;
+    std::unique_ptr<llvm::IRBuilder<>> builder;
+    llvm::DenseMap<Symbol, llvm::Value *> named_values;
+    // The buffer parameters of the function being emitted.
+    struct Buffer {
+        llvm::Value *data, *length;
+    };
+    llvm::DenseMap<Symbol, Buffer> buffers;
+    // Elements a loop is known to stay within: a buffer, indexed by the value of a loop variable.
+    llvm::DenseSet<std::pair<llvm::Value *, Symbol>> in_bounds;
+    llvm::DenseMap<Symbol, std::unique_ptr<PrototypeAST>> function_protos;
+    // Bodies of the definitions small enough to import into later modules.
+    struct Body {
+        ExprArena arena;
+        ExprId body;
+    };
+    llvm::DenseMap<Symbol, Body> function_bodies;
+    size_t import_budget = 64;
+    bool fast_math = false;
+    // Definitions the host can call by name, through a C entry point emitted on demand.
+    llvm::DenseSet<Symbol> entries;
+    // Definitions the host has asked to evaluate over arrays of arguments, through a batch entry point.
+    llvm::DenseSet<Symbol> batches;
+
+    CompilerSession(llvm::orc::KaleidoscopeJIT *jit, llvm::orc::JITDylib *dylib, llvm::DataLayout data_layout,
+                    std::unique_ptr<Lexer> lexer, std::ostream &diagnostics);
+
+public:
+    /// create - Open a session reading lexer, with a new JITDylib in jit, reporting errors to diagnostics.
+    static llvm::Expected<std::unique_ptr<CompilerSession>> create(llvm::orc::KaleidoscopeJIT &jit,
+                                                                  std::unique_ptr<Lexer> lexer,
+                                                                  std::ostream &diagnostics = std::cerr);
+    /// create - Open a session reading lexer, without a JIT, emitting modules for data_layout.
+    static std::unique_ptr<CompilerSession> create(const llvm::DataLayout &data_layout,
+                                                   std::unique_ptr<Lexer> lexer,
+                                                   std::ostream &diagnostics = std::cerr);
+    /// Removes the session's JITDylib, if it has one, so none of its code may still be running.
+    ~CompilerSession();
+    CompilerSession(const CompilerSession &) = delete;
+    CompilerSession &operator=(const CompilerSession &) = delete;
+
+    inline llvm::orc::JITDylib &get_dylib() { return *dylib; }
+    /// get_error_count - Number of errors reported so far. An item with an error is skipped.
+    inline unsigned get_error_count() const { return error_count; }
+
+    /// get_next_token/token - Provide a simple token buffer.
+    /// token is the current token the parser is looking at.
+    /// get_next_token reads another token from the lexer and updates it.
+    int get_next_token();
+    inline int token() const { return current_token; }
+
+    std::unique_ptr<FunctionAST> parse_definition();
+    std::unique_ptr<FunctionAST> parse_top_level_expr();
+    std::unique_ptr<PrototypeAST> parse_extern();
+
+    // An item is either a definition, a top-level expression, or an extern.
+    struct Item {
+        std::unique_ptr<FunctionAST> fn;
+        std::unique_ptr<PrototypeAST> proto;
+        bool is_expr;
+    };
+    /// parse_items - Parse the rest of the input, skipping the items with an error.
+    /// Nothing is emitted, and externs are not recorded: see update_function_proto.
+    std::vector<Item> parse_items();
+
+    /// codegen - Emit a declaration, or a definition, into the module being built.
+    llvm::Function *codegen(const PrototypeAST &proto);
+    llvm::Function *codegen(FunctionAST &fn);
+    /// update_function_proto - Remember an extern, so later modules can declare it too.
+    void update_function_proto(std::unique_ptr<PrototypeAST> &&proto_ast);
+    /// update_module - Hand the module built so far to the JIT under rt, the dylib's default tracker if null,
+    /// and start a new one.
+    llvm::Error update_module(llvm::orc::ResourceTrackerSP rt = nullptr);
+    /// compile_all - Parse the rest of the input, emit every definition into shards modules,
+    /// and hand them to the JIT together. Return the top-level expressions, compiled, in source order.
+    llvm::Expected<std::vector<double (*)()>> compile_all(unsigned shards = 1);
+    /// take_module - Take the module built so far out of the session, and start a new one.
+    llvm::orc::ThreadSafeModule take_module();
+    /// compile_module - Parse the rest of the input, and take every definition out in a single module.
+    /// Top-level expressions are left out, since nothing would run them.
+    /// With batch, every definition without buffers comes with its batch entry point too.
+    llvm::orc::ThreadSafeModule compile_module(bool batch = false);
+    /// set_import_budget - Largest definition, in expression nodes, copied into later modules that call it,
+    /// so they can be optimized together. 0 copies none, for a JIT that does not optimize.
+    inline void set_import_budget(size_t nodes) { import_budget = nodes; }
+    /// set_fast_math - Let the optimizer reassociate arithmetic and contract it into fused operations,
+    /// so sums over a loop can be vectorized, at the cost of results that may differ in the last bits.
+    void set_fast_math(bool on);
+    /// get_prototype - Prototype of the function called name, null if there is no such function.
+    const PrototypeAST *get_prototype(std::string_view name);
+
+    /// lookup/lookup_all - Find symbols this session defined, compiling them if needed.
+    /// lookup finds a definition by its name through a C entry point, emitted into a module of its own the first time.
+    llvm::Expected<llvm::JITEvaluatedSymbol> lookup(llvm::StringRef name);
+    /// lookup_batch - Find the batch entry point to the definition called name, see emit_batch,
+    /// emitted into a module of its own the first time. A definition taking buffers has none.
+    llvm::Expected<llvm::JITEvaluatedSymbol> lookup_batch(llvm::StringRef name);
+    llvm::Expected<std::vector<llvm::JITEvaluatedSymbol>> lookup_all(llvm::ArrayRef<std::string> names);
+
+private:
+    void initialize_module();
+    ExprId log_error(const char *str);
+    /// is_buffer - Whether name is a buffer parameter of the definition being parsed.
+    bool is_buffer(Symbol name) const;
+    std::unique_ptr<PrototypeAST> log_error_p(const char *str);
+    llvm::Value *log_error_v(const char *str);
+
+    ExprId parse_number_expr();
+    ExprId parse_paren_expr();
+    ExprId parse_identifier_expr();
+    ExprId parse_if_expr();
+    ExprId parse_for_expr();
+    ExprId parse_primary();
+    ExprId parse_unary();
+    ExprId parse_expression();
+    std::unique_ptr<PrototypeAST> parse_prototype();
+    static std::array<int8_t, 256> builtin_precedence();
+    int get_token_precedence() const;
+    void install_operator(const PrototypeAST &proto);
+    /// operator_symbol - Name of the function implementing a user defined operator, like "binary|".
+    Symbol operator_symbol(bool binary, char op);
+
+    /// body_name - Name of the function calls to proto reach. A definition is called through a body of its own,
+    /// with the fast calling convention, the plain name being the host's C entry point to it.
+    std::string body_name(const PrototypeAST &proto);
+    /// function_type - Type of the function proto: double(double,double,...) etc,
+    /// with a pointer and a 64-bit length in place of each buffer.
+    llvm::FunctionType *function_type(const PrototypeAST &proto);
+    llvm::Function *get_function(Symbol name);
+    /// describe_extern - Fill in what is known of an extern of the C math library:
+    /// its effects, and the intrinsic calls to it are lowered to.
+    void describe_extern(PrototypeAST &proto);
+    /// get_intrinsic - The intrinsic a call to name is lowered to, null if it is not a known extern.
+    llvm::Function *get_intrinsic(Symbol name);
+    /// infer_effects - Effects of the function proto, whose body is every node of arena.
+    /// A call to a function defined later, or to any other extern, may do anything.
+    Effects infer_effects(const PrototypeAST &proto, const ExprArena &arena);
+    /// apply_effects - Turn effects into attributes, of a function or of a call to it.
+    static void apply_effects(llvm::Function &f, const Effects &e);
+    static void apply_effects(llvm::CallBase &call, const llvm::Function &callee);
+    /// emit_body - Emit a body for f, removing what was emitted of it on error.
+    bool emit_body(llvm::Function *f, const PrototypeAST &proto, const ExprArena &arena, ExprId body);
+    /// emit_entry - Define the host's entry point to body, the definition of proto, under its plain name.
+    /// Kaleidoscope code never calls it, so it is only emitted for the host, or for calls through an extern.
+    void emit_entry(llvm::Function *body, const PrototypeAST &proto);
+    /// emit_batch - Define name_batch, calling body, the definition of proto, once for each of n rows:
+    /// `void f_batch(const double *a, const double *b, double *out, size_t n)` for `def f(a b)`.
+    /// The inputs are arrays, one for each parameter, and the body is inlined into the loop if it can be.
+    void emit_batch(llvm::Function *body, const PrototypeAST &proto);
+    /// emit_tail - Emit the expression id in tail position, returning its value.
+    /// A call whose value is returned is a tail call, guaranteed to reuse the frame if the callee is alike.
+    bool emit_tail(const ExprArena &arena, ExprId id);
+    /// emit_call - Call callee, as its calling convention and effects say.
+    llvm::CallInst *emit_call(llvm::Function *callee, llvm::ArrayRef<llvm::Value *> args, const char *name);
+    /// import_body - Give f, defined by an earlier module, an available_externally copy of its body.
+    void import_body(llvm::Function *f, const PrototypeAST &proto, const Body &body);
+    llvm::Value *codegen_expr(const ExprArena &arena, ExprId id);
+    llvm::Value *codegen_number(double val);
+    llvm::Value *codegen_variable(Symbol name);
+    llvm::Value *codegen_unary(const ExprArena &arena, const UnaryExprAST &e);
+    llvm::Value *emit_binary_op(char op, llvm::Value *l, llvm::Value *r);
+    llvm::Value *codegen_binary(const ExprArena &arena, const BinaryExprAST &e);
+    llvm::Value *codegen_call(const ExprArena &arena, const CallExprAST &e);
+    llvm::Value *codegen_if(const ExprArena &arena, const IfExprAST &e);
+    llvm::Value *codegen_for(const ExprArena &arena, const ForExprAST &e);
+    /// codegen_index - Read, or write, an element of a buffer, trapping if it is out of bounds,
+    /// unless the index is a loop variable known to stay within them.
+    llvm::Value *codegen_index(const ExprArena &arena, const IndexExprAST &e);
+    llvm::Value *codegen_length(Symbol buffer);
+    /// CountedLoop - A for loop counting in integers doubles represent exactly: from a constant start,
+    /// by a constant step, while its variable is below, or above, a bound that is the same in every iteration.
+    struct CountedLoop {
+        int64_t start, step;
+        ExprId bound;
+        bool below;// var < bound, rather than bound < var
+    };
+    static bool is_counted(const ExprArena &arena, const ForExprAST &e, CountedLoop &loop);
+    /// emit_limit - Emit the bound of a counted loop, as the integer its counter is compared with.
+    llvm::Value *emit_limit(const ExprArena &arena, const CountedLoop &loop);
+    /// emit_steps - Emit the number of steps a counted loop counting towards limit takes,
+    /// one less than the number of times its body runs.
+    llvm::Value *emit_steps(const CountedLoop &loop, llvm::Value *limit);
+    /// codegen_counted_for - Emit a counted loop with an integer induction variable,
+    /// which the loop optimizer can find the trip count of, and unroll or vectorize.
+    llvm::Value *codegen_counted_for(const ExprArena &arena, const ForExprAST &e, const CountedLoop &loop);
+    /// emit_loop_versions - Emit a counted loop, running from the counter first to last.
+    /// When its body indexes buffers by the variable, it is emitted twice:
+    /// one copy free of bounds checks, run when every element the loop can index is in bounds, and a checked one.
+    llvm::Value *emit_loop_versions(const ExprArena &arena, const ForExprAST &e, const CountedLoop &loop,
+                                    llvm::Value *first, llvm::Value *last, llvm::Value *limit);
+    /// emit_counted_loop - Emit the loop itself, from first up to limit, with the elements of unchecked known in bounds.
+    /// Return the reduced value of the iterations of a pfor, 0 for a for.
+    llvm::Value *emit_counted_loop(const ExprArena &arena, const ForExprAST &e, const CountedLoop &loop,
+                                   llvm::Value *first, llvm::Value *limit, llvm::ArrayRef<Symbol> unchecked);
+    /// codegen_pfor - Outline the body of a counted loop into a function running a range of its iterations,
+    /// with everything in scope passed through a context, and have the runtime run all of them on many threads.
+    llvm::Value *codegen_pfor(const ExprArena &arena, const ForExprAST &e);
+};
+
+#endif// __SESSION_H__
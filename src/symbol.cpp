@@ -0,0 +1,8 @@
+#include "symbol.h"
+
+Symbol SymbolTable::intern(std::string_view str) {
+    auto [it, inserted] = ids.try_emplace(llvm::StringRef(str.data(), str.size()), names.size());
+    // The key is copied into the map, so the spelling stays valid after the source buffer moves.
+    if (inserted) names.push_back(it->getKey());
+    return it->getValue();
+}
@@ -0,0 +1,27 @@
+#ifndef __SYMBOL_H__
+#define __SYMBOL_H__
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/// Symbol - A small integer naming an interned identifier.
+using Symbol = uint32_t;
+
+/// SymbolTable - Gives every distinct identifier a dense id, and the id back its spelling.
+class SymbolTable {
+    llvm::StringMap<Symbol, llvm::BumpPtrAllocator> ids;
+    std::vector<llvm::StringRef> names;
+
+public:
+    /// intern - Return the id of str, assigning the next one if it is new.
+    Symbol intern(std::string_view str);
+
+    inline llvm::StringRef name(Symbol id) const { return names[id]; }
+    inline size_t size() const { return names.size(); }
+};
+
+#endif// __SYMBOL_H__